@@ -0,0 +1,269 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+// Checks the optimizer kernels picked at runtime against plain per-byte
+// and per-pixel arithmetic on random images. Run it once for each
+// PNGLOSS_CPU setting to cover every set of kernels; all of them must match
+// exactly.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color_delta.h"
+#include "cpu_dispatch.h"
+#include "optimize_state.h"
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+// noisy, flat or stepped rows, so that every filter sees small and large
+// differences and wraps both ways
+static void fill_row(unsigned char *row, size_t rowbytes, uint_fast8_t bytes_per_pixel) {
+    uint32_t content = next_random() % 3;
+    unsigned char level = next_random();
+    for (size_t i = 0; i < rowbytes; i++) {
+        if (content == 0) {
+            row[i] = next_random();
+        } else if (content == 1) {
+            row[i] = level + (next_random() % 3) - 1;
+        } else {
+            row[i] = (i / bytes_per_pixel / 4) % 2 ? level : 255 - level;
+        }
+    }
+}
+
+static unsigned char reference_predict(
+    pngloss_filter filter, unsigned char above, unsigned char diag, unsigned char left
+) {
+    switch (filter) {
+    case pngloss_sub:
+        return pngloss_filter_sub(above, diag, left);
+    case pngloss_up:
+        return pngloss_filter_up(above, diag, left);
+    case pngloss_average:
+        return pngloss_filter_average(above, diag, left);
+    case pngloss_paeth:
+        return pngloss_filter_paeth(above, diag, left);
+    default:
+        return pngloss_filter_none(above, diag, left);
+    }
+}
+
+static void reference_filter_row(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered
+) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    for (size_t i = 0; i < rowbytes; i++) {
+        unsigned char above = 0, diag = 0, left = 0;
+        if (i >= image->bytes_per_pixel) {
+            left = pixels[i - image->bytes_per_pixel];
+            if (above_row) {
+                diag = above_row[i - image->bytes_per_pixel];
+            }
+        }
+        if (above_row) {
+            above = above_row[i];
+        }
+        filtered[i] = pixels[i] - reference_predict(filter, above, diag, left);
+    }
+}
+
+// filter_row, filter_sums_for_rows and the banked histograms of
+// image_analysis_init
+static bool check_filters(pngloss_image *image, unsigned char *filtered, unsigned char *expected) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    image_analysis expected_analysis;
+    memset(&expected_analysis, 0, sizeof(expected_analysis));
+
+    for (uint32_t y = 0; y < image->height; y++) {
+        unsigned char *above_row = y ? image->rows[y - 1] : NULL;
+        uint64_t expected_sums[pngloss_filter_count];
+        for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+            reference_filter_row(image, above_row, image->rows[y], filter, expected);
+            expected_sums[filter] = 0;
+            for (size_t i = 0; i < rowbytes; i++) {
+                expected_sums[filter] += expected[i] < 128 ? expected[i] : 256 - expected[i];
+                expected_analysis.original_frequency[filter][expected[i]]++;
+            }
+
+            filter_row(image, above_row, image->rows[y], filter, filtered);
+            if (memcmp(filtered, expected, rowbytes)) {
+                fprintf(stderr, "filter_row differs: filter %d, %ux%u at %u bytes per pixel, row %u\n",
+                    (int)filter, image->width, image->height, (unsigned int)image->bytes_per_pixel, y);
+                return false;
+            }
+        }
+
+        uint64_t sums[pngloss_filter_count];
+        filter_sums_for_rows(image, above_row, image->rows[y], sums);
+        if (memcmp(sums, expected_sums, sizeof(sums))) {
+            fprintf(stderr, "filter_sums_for_rows differs: %ux%u at %u bytes per pixel, row %u\n",
+                image->width, image->height, (unsigned int)image->bytes_per_pixel, y);
+            return false;
+        }
+    }
+
+    for (uint_fast8_t thread_count = 1; thread_count <= 3; thread_count++) {
+        image_analysis analysis;
+        if (SUCCESS != image_analysis_init(&analysis, image, thread_count)) {
+            fputs("image_analysis_init failed\n", stderr);
+            return false;
+        }
+        if (memcmp(&analysis, &expected_analysis, sizeof(analysis))) {
+            fprintf(stderr, "image_analysis_init differs: %ux%u at %u bytes per pixel, %u threads\n",
+                image->width, image->height, (unsigned int)image->bytes_per_pixel, (unsigned int)thread_count);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the per-pixel distortion run_pixel used to add up, built from the
+// color_delta helpers
+static uint32_t reference_row_error(
+    pngloss_image *image, unsigned char *pixels, unsigned char *last_row_pixels,
+    uint32_t y, uint32_t start, uint32_t end
+) {
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    uint32_t total_error = 0;
+    for (uint32_t x = start; x < end; x++) {
+        int_fast16_t back_color[4], original_color[4];
+        int_fast16_t old_above_color[4], new_above_color[4];
+        int_fast16_t old_diag_color[4], new_diag_color[4];
+        int_fast16_t old_left_color[4], new_left_color[4];
+        for (uint_fast8_t c = 0; c < bytes_per_pixel; c++) {
+            size_t offset = (size_t)x * bytes_per_pixel + c;
+            original_color[c] = image->rows[y][offset];
+            back_color[c] = pixels[offset];
+
+            unsigned char above = 0, old_above = 0, diag = 0, old_diag = 0, left = 0, old_left = 0;
+            if (y > 0) {
+                above = image->rows[y - 1][offset];
+                old_above = last_row_pixels[offset];
+                if (x > 0) {
+                    diag = image->rows[y - 1][offset - bytes_per_pixel];
+                    old_diag = last_row_pixels[offset - bytes_per_pixel];
+                }
+            }
+            if (x > 0) {
+                left = pixels[offset - bytes_per_pixel];
+                old_left = image->rows[y][offset - bytes_per_pixel];
+            }
+            old_above_color[c] = old_above;
+            new_above_color[c] = above;
+            old_diag_color[c] = old_diag;
+            new_diag_color[c] = diag;
+            old_left_color[c] = old_left;
+            new_left_color[c] = left;
+        }
+
+        color_delta old_partial, new_partial;
+        color_d2 d2;
+        color_difference(bytes_per_pixel, old_partial, original_color, old_above_color);
+        color_difference(bytes_per_pixel, new_partial, back_color, new_above_color);
+        color_delta_difference(new_partial, old_partial, d2);
+        total_error += color_delta_distance(d2);
+
+        color_difference(bytes_per_pixel, old_partial, original_color, old_diag_color);
+        color_difference(bytes_per_pixel, new_partial, back_color, new_diag_color);
+        color_delta_difference(new_partial, old_partial, d2);
+        total_error += color_delta_distance(d2);
+
+        color_difference(bytes_per_pixel, old_partial, original_color, old_left_color);
+        color_difference(bytes_per_pixel, new_partial, back_color, new_left_color);
+        color_delta_difference(new_partial, old_partial, d2);
+        total_error += color_delta_distance(d2);
+    }
+    return total_error;
+}
+
+// row_error over whole rows and random pixel ranges, with the optimized
+// row and the original above row both random
+static bool check_row_error(pngloss_image *image, unsigned char *pixels, unsigned char *last_row_pixels) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    for (uint32_t y = 0; y < image->height; y++) {
+        fill_row(pixels, rowbytes, image->bytes_per_pixel);
+        fill_row(last_row_pixels, rowbytes, image->bytes_per_pixel);
+        optimize_state state = {.y = y, .pixels = pixels};
+
+        for (uint_fast8_t range = 0; range < 4; range++) {
+            uint32_t start = 0, end = image->width;
+            if (range) {
+                start = next_random() % (image->width + 1);
+                end = start + next_random() % (image->width - start + 1);
+            }
+            uint32_t expected = reference_row_error(image, pixels, last_row_pixels, y, start, end);
+            uint32_t error = optimize_state_row_error(&state, image, last_row_pixels, start, end);
+            if (error != expected) {
+                fprintf(stderr, "row_error differs: %ux%u at %u bytes per pixel, row %u, pixels %u-%u: %u, expected %u\n",
+                    image->width, image->height, (unsigned int)image->bytes_per_pixel, y, start, end, error, expected);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(void) {
+    const unsigned int image_count = 3000;
+    const uint32_t max_width = 70, max_height = 6;
+
+    unsigned char *rows[6];
+    unsigned char *filtered = malloc((size_t)max_width * 4);
+    unsigned char *expected = malloc((size_t)max_width * 4);
+    unsigned char *optimized = malloc((size_t)max_width * 4);
+    unsigned char *last_row_pixels = malloc((size_t)max_width * 4);
+    if (!filtered || !expected || !optimized || !last_row_pixels) {
+        fputs("out of memory\n", stderr);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    bool passed = true;
+    for (unsigned int n = 0; passed && n < image_count; n++) {
+        pngloss_image image = {
+            .rows = rows,
+            .width = 1 + next_random() % max_width,
+            .height = 1 + next_random() % max_height,
+            .bytes_per_pixel = 1 + next_random() % 4
+        };
+        // rows of exactly their own size, so that reads past the end show
+        // up under a memory checker
+        size_t rowbytes = (size_t)image.width * image.bytes_per_pixel;
+        for (uint32_t y = 0; y < image.height; y++) {
+            rows[y] = malloc(rowbytes);
+            if (!rows[y]) {
+                fputs("out of memory\n", stderr);
+                return OUT_OF_MEMORY_ERROR;
+            }
+            fill_row(rows[y], rowbytes, image.bytes_per_pixel);
+        }
+
+        passed = check_filters(&image, filtered, expected) &&
+            check_row_error(&image, optimized, last_row_pixels);
+
+        for (uint32_t y = 0; y < image.height; y++) {
+            free(rows[y]);
+        }
+    }
+
+    free(filtered);
+    free(expected);
+    free(optimized);
+    free(last_row_pixels);
+
+    printf("%s kernels: %s\n", pngloss_kernels_name(pngloss_selected_kernels()), passed ? "pass" : "FAIL");
+    return passed ? SUCCESS : INTERNAL_ERROR;
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+# Runs check_kernels once with each set of kernels. Sets this build or CPU
+# can't use fall back to the best one they can, so every run must pass.
+for kernels in scalar sse2 avx2; do
+    PNGLOSS_CPU=$kernels ./check_kernels || exit 1
+done
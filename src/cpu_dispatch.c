@@ -0,0 +1,93 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_dispatch.h"
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static pngloss_kernels supported_kernels = pngloss_kernels_scalar;
+static pngloss_kernels selected_kernels = pngloss_kernels_scalar;
+static pngloss_kernels_request kernels_request = pngloss_kernels_request_none;
+static const char *requested_kernels = NULL;
+
+static const char *kernel_names[] = {"scalar", "sse2", "avx2"};
+
+// Picks the best kernels this build and CPU both support. PNGLOSS_CPU can
+// name a lower set to use instead, for testing. Any other value is ignored
+// and only recorded, since the library prints nothing.
+static void detect_kernels(void) {
+#if defined(__SSE2__)
+    supported_kernels = pngloss_kernels_sse2;
+#endif
+#if defined(PNGLOSS_X86_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        supported_kernels = pngloss_kernels_avx2;
+    }
+#endif
+    selected_kernels = supported_kernels;
+
+    const char *requested = getenv("PNGLOSS_CPU");
+    if (!requested || !*requested) {
+        return;
+    }
+    requested_kernels = requested;
+    for (pngloss_kernels kernels = pngloss_kernels_scalar; kernels <= pngloss_kernels_avx2; kernels++) {
+        if (!strcmp(requested, kernel_names[kernels])) {
+            if (kernels <= supported_kernels) {
+                selected_kernels = kernels;
+                kernels_request = pngloss_kernels_request_used;
+            } else {
+                kernels_request = pngloss_kernels_request_unsupported;
+            }
+            return;
+        }
+    }
+    kernels_request = pngloss_kernels_request_unknown;
+}
+
+pngloss_kernels pngloss_selected_kernels(void) {
+    pthread_once(&detect_once, detect_kernels);
+    return selected_kernels;
+}
+
+// Reports whether PNGLOSS_CPU was used, and its value in *requested_p if
+// requested_p isn't NULL, so that a program can warn about an ignored one.
+pngloss_kernels_request pngloss_selected_kernels_request(const char **requested_p) {
+    pthread_once(&detect_once, detect_kernels);
+    if (requested_p) {
+        *requested_p = requested_kernels;
+    }
+    return kernels_request;
+}
+
+const char *pngloss_kernels_name(pngloss_kernels kernels) {
+    return kernel_names[kernels];
+}
+
+void pngloss_print_cpu_config(FILE *fd) {
+    fprintf(fd, "   Optimizer kernels: %s", pngloss_kernels_name(pngloss_selected_kernels()));
+#if defined(PNGLOSS_X86_DISPATCH)
+    fputs(" (CPU has", fd);
+    if (__builtin_cpu_supports("sse2")) {
+        fputs(" sse2", fd);
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        fputs(" ssse3", fd);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        fputs(" avx2", fd);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        fputs(" avx512f", fd);
+    }
+    fputs(")", fd);
+#endif
+    fputs("\n", fd);
+}
@@ -0,0 +1,35 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <stdio.h>
+
+// GCC and clang can build AVX2 kernels into an x86 binary that doesn't
+// otherwise require AVX2, and pick them only on CPUs that have it
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define PNGLOSS_X86_DISPATCH 1
+#endif
+
+// data structures
+
+// sets of optimizer kernels, each one building on the one before
+typedef enum {
+    pngloss_kernels_scalar,
+    pngloss_kernels_sse2,
+    pngloss_kernels_avx2
+} pngloss_kernels;
+
+// what became of the PNGLOSS_CPU setting
+typedef enum {
+    pngloss_kernels_request_none, // unset or empty
+    pngloss_kernels_request_used,
+    pngloss_kernels_request_unknown, // not the name of a set
+    pngloss_kernels_request_unsupported // a set this build or CPU lacks
+} pngloss_kernels_request;
+
+// function prototypes
+pngloss_kernels pngloss_selected_kernels(void);
+pngloss_kernels_request pngloss_selected_kernels_request(const char **requested_p);
+const char *pngloss_kernels_name(pngloss_kernels kernels);
+void pngloss_print_cpu_config(FILE *fd);
+
+#endif // CPU_DISPATCH_H
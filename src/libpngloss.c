@@ -0,0 +1,199 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libpngloss.h"
+#include "pngloss_image.h"
+#include "rwpng.h"
+
+struct pngloss_context {
+    uint_fast8_t strength;
+    int_fast16_t bleed_divider;
+    uint_fast8_t thread_count;
+    uint32_t band_count;
+    uint_fast8_t level;
+    bool strip;
+    uint64_t max_pixels;
+    unsigned long time_limit;
+    pngloss_scratch scratch;
+};
+
+pngloss_context *pngloss_context_create(void) {
+    pngloss_context *context = malloc(sizeof(pngloss_context));
+    if (context) {
+        *context = (pngloss_context){
+            .strength = 19,
+            .bleed_divider = 2,
+            .thread_count = 1,
+            .band_count = 1,
+            .level = 9
+        };
+    }
+    return context;
+}
+
+void pngloss_context_destroy(pngloss_context *context) {
+    if (context) {
+        pngloss_scratch_free(&context->scratch);
+        free(context);
+    }
+}
+
+pngloss_error pngloss_set_strength(pngloss_context *context, unsigned int strength) {
+    if (strength > 255) {
+        return INVALID_ARGUMENT;
+    }
+    context->strength = strength;
+    return SUCCESS;
+}
+
+pngloss_error pngloss_set_bleed_divider(pngloss_context *context, unsigned int bleed_divider) {
+    if (bleed_divider < 1 || bleed_divider > 32767) {
+        return INVALID_ARGUMENT;
+    }
+    context->bleed_divider = bleed_divider;
+    return SUCCESS;
+}
+
+pngloss_error pngloss_set_threads(pngloss_context *context, unsigned int thread_count) {
+    if (thread_count < 1 || thread_count > 255) {
+        return INVALID_ARGUMENT;
+    }
+    context->thread_count = thread_count;
+    return SUCCESS;
+}
+
+pngloss_error pngloss_set_bands(pngloss_context *context, uint32_t band_count) {
+    if (band_count < 1 || band_count > 65535) {
+        return INVALID_ARGUMENT;
+    }
+    context->band_count = band_count;
+    return SUCCESS;
+}
+
+pngloss_error pngloss_set_level(pngloss_context *context, unsigned int level) {
+    if (level < 1 || level > 9) {
+        return INVALID_ARGUMENT;
+    }
+    context->level = level;
+    return SUCCESS;
+}
+
+void pngloss_set_strip(pngloss_context *context, bool strip) {
+    context->strip = strip;
+}
+
+void pngloss_set_max_pixels(pngloss_context *context, uint64_t max_pixels) {
+    context->max_pixels = max_pixels;
+}
+
+void pngloss_set_time_limit(pngloss_context *context, unsigned long seconds) {
+    context->time_limit = seconds;
+}
+
+// the time limit counted from now, or NULL for none
+static const struct timespec *start_time_limit(pngloss_context *context, struct timespec *deadline) {
+    if (!context->time_limit) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += context->time_limit;
+    return deadline;
+}
+
+pngloss_error pngloss_optimize_rgba(
+    pngloss_context *context, unsigned char *pixels,
+    uint32_t width, uint32_t height, size_t stride,
+    unsigned char *row_filters
+) {
+    if (!context || !pixels || !width || !height || stride / 4 < width) {
+        return INVALID_ARGUMENT;
+    }
+
+    struct timespec deadline;
+    const struct timespec *deadline_p = start_time_limit(context, &deadline);
+    unsigned char **rows = pngloss_scratch_rows(&context->scratch, pixels, height, stride);
+    if (!rows) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    return optimize_with_scratch(
+        &context->scratch, rows, width, height, row_filters, false,
+        context->strength, context->bleed_divider, context->thread_count,
+        context->band_count, context->level, deadline_p
+    );
+}
+
+pngloss_error pngloss_compress_png(
+    pngloss_context *context, const unsigned char *png, size_t png_size,
+    unsigned char **out_p, size_t *out_size_p
+) {
+    if (!context || !png || !out_p || !out_size_p) {
+        return INVALID_ARGUMENT;
+    }
+    *out_p = NULL;
+    *out_size_p = 0;
+    struct timespec deadline;
+    const struct timespec *deadline_p = start_time_limit(context, &deadline);
+
+    // the decoder takes over the context's pixel and row buffers, reusing
+    // them if they are large enough, and hands them back at the end
+    pngloss_scratch *scratch = &context->scratch;
+    png24_image image = {
+        .quiet = true,
+        .max_pixels = context->max_pixels,
+        .row_pointers = scratch->rows,
+        .row_pointers_height = scratch->rows_size / sizeof(scratch->rows[0]),
+        .pixel_data = scratch->pixels,
+        .pixel_data_size = scratch->pixels_size
+    };
+    scratch->rows = NULL;
+    scratch->pixels = NULL;
+    scratch->rows_size = scratch->pixels_size = 0;
+    pngloss_error retval = rwpng_read_image24_buffer(png, png_size, &image, context->strip, false);
+
+    unsigned char *row_filters = NULL;
+    if (SUCCESS == retval) {
+        row_filters = pngloss_scratch_row_filters(scratch, image.height);
+        if (!row_filters) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+    if (SUCCESS == retval) {
+        pngloss_image optimized = {
+            .rows = image.row_pointers,
+            .width = image.width,
+            .height = image.height,
+            .bytes_per_pixel = image.bytes_per_pixel
+        };
+        retval = optimize_image(
+            &optimized, row_filters, false, context->strength,
+            context->bleed_divider, context->thread_count, context->band_count,
+            context->level, deadline_p
+        );
+    }
+    // the compressed file is rarely larger than the original
+    if (SUCCESS == retval) {
+        retval = rwpng_write_image24_buffer(out_p, png_size, &image, row_filters, context->thread_count, 1);
+    }
+    if (SUCCESS == retval) {
+        *out_size_p = image.file_size;
+    }
+
+    scratch->rows = image.row_pointers;
+    scratch->rows_size = image.row_pointers_height * sizeof(scratch->rows[0]);
+    image.row_pointers = NULL;
+    if (!image.mapped_size) {
+        scratch->pixels = image.pixel_data;
+        scratch->pixels_size = image.pixel_data_size;
+        image.pixel_data = NULL;
+    }
+    rwpng_free_image24(&image);
+    return retval;
+}
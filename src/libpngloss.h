@@ -0,0 +1,79 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+#ifndef LIBPNGLOSS_H
+#define LIBPNGLOSS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    SUCCESS = 0,
+    MISSING_ARGUMENT = 1,
+    READ_ERROR = 2,
+    INVALID_ARGUMENT = 4,
+    NOT_OVERWRITING_ERROR = 15,
+    CANT_WRITE_ERROR = 16,
+    OUT_OF_MEMORY_ERROR = 17,
+    WRONG_ARCHITECTURE = 18, // Missing SSE
+    PNG_OUT_OF_MEMORY_ERROR = 24,
+    LIBPNG_FATAL_ERROR = 25,
+    WRONG_INPUT_COLOR_TYPE = 26,
+    NOT_STREAMABLE = 27,
+    LIBPNG_INIT_ERROR = 35,
+    INTERNAL_ERROR = 36,
+    SERVER_BUSY = 37,
+    TIMED_OUT = 38,
+    TOO_MANY_PIXELS = 39,
+    TOO_LARGE_FILE = 98,
+    TOO_LOW_QUALITY = 99,
+} pngloss_error;
+
+// A context holds the settings for compressing images and the buffers that
+// were needed last time, so that compressing many images of similar size
+// allocates little. Nothing is shared between contexts, so each thread can
+// use its own. One context must not be used by two threads at once.
+typedef struct pngloss_context pngloss_context;
+
+// function prototypes
+pngloss_context *pngloss_context_create(void);
+void pngloss_context_destroy(pngloss_context *context);
+
+// Each setter returns INVALID_ARGUMENT and leaves the setting alone if the
+// value is out of range. The defaults match the pngloss command.
+pngloss_error pngloss_set_strength(pngloss_context *context, unsigned int strength); // 0-255, default 19
+pngloss_error pngloss_set_bleed_divider(pngloss_context *context, unsigned int bleed_divider); // 1-32767, default 2
+pngloss_error pngloss_set_threads(pngloss_context *context, unsigned int thread_count); // 1-255, default 1
+pngloss_error pngloss_set_bands(pngloss_context *context, uint32_t band_count); // 1-65535, default 1
+pngloss_error pngloss_set_level(pngloss_context *context, unsigned int level); // 1-9, default 9
+void pngloss_set_strip(pngloss_context *context, bool strip); // drop metadata, default false
+void pngloss_set_max_pixels(pngloss_context *context, uint64_t max_pixels); // 0 for no limit, default 0
+void pngloss_set_time_limit(pngloss_context *context, unsigned long seconds); // 0 for no limit, default 0
+
+// Optimizes RGBA pixels in place, rows stride bytes apart. If row_filters
+// isn't NULL it receives the PNG filter to write each of the height rows
+// with. Nothing is printed; failures are only reported by the return value.
+// Past the time_limit setting, counted from the call, it stops between rows
+// and returns TIMED_OUT, leaving the pixels partly optimized.
+pngloss_error pngloss_optimize_rgba(
+    pngloss_context *context, unsigned char *pixels,
+    uint32_t width, uint32_t height, size_t stride,
+    unsigned char *row_filters
+);
+
+// Compresses a whole PNG file held in memory. On success *out_p is a new
+// buffer of *out_size_p bytes holding the compressed file, which the caller
+// frees. Nothing touches the filesystem. Files that declare more pixels
+// than the max_pixels setting are refused with TOO_MANY_PIXELS before any
+// pixels are allocated. Optimizing stops with TIMED_OUT once the
+// time_limit setting runs out, though writing the file isn't interrupted.
+pngloss_error pngloss_compress_png(
+    pngloss_context *context, const unsigned char *png, size_t png_size,
+    unsigned char **out_p, size_t *out_size_p
+);
+
+#endif // LIBPNGLOSS_H
@@ -19,26 +19,48 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "cpu_dispatch.h"
 #include "optimize_state.h"
+#include "thread_pool.h"
 
 const uint_fast8_t dither_row_count = 3;
 const uint_fast8_t dither_filter_width = 5;
 const uint_fast16_t symbol_count = 256;
-
-pngloss_error optimize_state_init(
+const uint32_t error_fetch_columns = 64;
+const uint_fast8_t symbol_block_size = 16;
+const uint_fast16_t band_floor_count = 512;
+const uint32_t error_block_pixels = 16;
+
+#if defined(__GNUC__)
+#define always_inline inline __attribute__((always_inline))
+#else
+#define always_inline inline
+#endif
+
+static pngloss_error optimize_state_alloc(
     optimize_state *state, pngloss_image *image
 ) {
     state->x = 0;
     state->y = 0;
     state->symbol_count = 0;
 
+    state->error_source = NULL;
+    state->error_columns = 0;
+    state->error_row = 0;
+    state->row_symbol_end = 0;
+    state->cost_floor = 0;
+    state->failed = false;
+    state->band_strength = 256;
+
     // clear values in case we return early and later free uninitialized pointers
     state->pixels = NULL;
     state->color_error = NULL;
     state->symbol_frequency = NULL;
-    for (uint_fast8_t filter = 0; filter < 5; filter++) {
-        state->original_frequency[filter] = NULL;
-    }
+    state->analysis = NULL;
 
     state->pixels = calloc((size_t)image->width, image->bytes_per_pixel);
     if (!state->pixels) {
@@ -56,32 +78,167 @@ pngloss_error optimize_state_init(
         return OUT_OF_MEMORY_ERROR;
     }
 
-    for (uint_fast8_t i = 0; i < 5; i++) {
-        state->original_frequency[i] = calloc(symbol_count, sizeof(uint32_t));
-        if (!state->original_frequency[i]) {
-            return OUT_OF_MEMORY_ERROR;
-        }
+    return SUCCESS;
+}
+
+typedef struct {
+    pngloss_image *image;
+    uint32_t stripe_count;
+    uint64_t (*frequency)[5][256];
+    pngloss_error *results;
+} analysis_job;
+
+// Counts the filtered symbols of one horizontal stripe of the image. Only
+// the original pixels are read, so stripes are independent.
+static void analyze_stripe(void *context, uint32_t index) {
+    analysis_job *job = context;
+    pngloss_image *image = job->image;
+    uint32_t start_y = (uint32_t)((uint64_t)image->height * index / job->stripe_count);
+    uint32_t end_y = (uint32_t)((uint64_t)image->height * (index + 1) / job->stripe_count);
+    uint64_t (*frequency)[256] = job->frequency[index];
+
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    unsigned char *filtered = malloc(rowbytes);
+    if (!filtered) {
+        job->results[index] = OUT_OF_MEMORY_ERROR;
+        return;
     }
 
+    // Count into four banks so consecutive equal symbols don't wait on
+    // each other's increments, then add the banks together.
+    uint64_t banks[4][256];
     for (uint_fast8_t filter = 0; filter < 5; filter++) {
-        for (uint32_t y = 0; y < image->height; y++) {
-            for (uint32_t x = 0; x < image->width; x++) {
-                for (uint32_t c = 0; c < image->bytes_per_pixel; c++) {
-                    uint32_t offset = x*image->bytes_per_pixel + c;
-                    unsigned char color = image->rows[y][offset];
-                    unsigned char left = 0;
-                    if (x > 0) {
-                        left = image->rows[y][offset-image->bytes_per_pixel];
-                    }
-                    unsigned char predicted = filter_predict(image, x, y, filter, c, left);
-                    unsigned char filtered = color - predicted;
-                    //fprintf(stderr, "color %d predicted %d filtered %d\n", (int)color, (int)predicted, (int)filtered);
-                    state->original_frequency[filter][filtered]++;
+        memset(banks, 0, sizeof(banks));
+        for (uint32_t y = start_y; y < end_y; y++) {
+            unsigned char *above_row = NULL;
+            if (y > 0) {
+                above_row = image->rows[y - 1];
+            }
+            filter_row(image, above_row, image->rows[y], filter, filtered);
+
+            size_t i = 0;
+            for (; i + 4 <= rowbytes; i += 4) {
+                banks[0][filtered[i + 0]]++;
+                banks[1][filtered[i + 1]]++;
+                banks[2][filtered[i + 2]]++;
+                banks[3][filtered[i + 3]]++;
+            }
+            for (; i < rowbytes; i++) {
+                banks[0][filtered[i]]++;
+            }
+        }
+        for (uint_fast16_t symbol = 0; symbol < symbol_count; symbol++) {
+            frequency[filter][symbol] = banks[0][symbol] + banks[1][symbol] + banks[2][symbol] + banks[3][symbol];
+        }
+    }
+    free(filtered);
+
+    job->results[index] = SUCCESS;
+}
+
+pngloss_error image_analysis_init(
+    image_analysis *analysis, pngloss_image *image, uint_fast8_t thread_count
+) {
+    pngloss_error retval = SUCCESS;
+
+    // one stripe per thread, and every stripe needs at least one row
+    uint32_t stripe_count = thread_count;
+    if (stripe_count > image->height) {
+        stripe_count = image->height;
+    }
+    if (stripe_count < 1) {
+        stripe_count = 1;
+    }
+
+    uint64_t (*frequency)[5][256] = calloc(stripe_count, sizeof(*frequency));
+    pngloss_error *results = calloc(stripe_count, sizeof(pngloss_error));
+    if (!frequency || !results) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    thread_pool pool;
+    bool pool_started = false;
+    if (SUCCESS == retval) {
+        retval = thread_pool_init(&pool, stripe_count);
+        pool_started = (SUCCESS == retval);
+    }
+
+    if (SUCCESS == retval) {
+        analysis_job job = {
+            .image = image,
+            .stripe_count = stripe_count,
+            .frequency = frequency,
+            .results = results
+        };
+        thread_pool_run(&pool, analyze_stripe, stripe_count, &job);
+
+        for (uint32_t stripe = 0; stripe < stripe_count; stripe++) {
+            if (SUCCESS != results[stripe]) {
+                retval = results[stripe];
+                break;
+            }
+        }
+        // images over 4G bytes can count more of one symbol than fits,
+        // and saturated counts still rank above all smaller ones
+        for (uint_fast8_t filter = 0; SUCCESS == retval && filter < 5; filter++) {
+            for (uint_fast16_t symbol = 0; symbol < symbol_count; symbol++) {
+                uint64_t total = 0;
+                for (uint32_t stripe = 0; stripe < stripe_count; stripe++) {
+                    total += frequency[stripe][filter][symbol];
                 }
+                analysis->original_frequency[filter][symbol] = total < UINT32_MAX ? (uint32_t)total : UINT32_MAX;
             }
         }
     }
 
+    if (pool_started) {
+        thread_pool_destroy(&pool);
+    }
+    free(frequency);
+    free(results);
+
+    return retval;
+}
+
+// Counts the filtered symbols of one more row, for callers that only see the
+// image a row at a time. The analysis must start out zeroed and filtered
+// must hold a row.
+void image_analysis_add_row(
+    image_analysis *analysis, pngloss_image *image,
+    unsigned char *above_row, unsigned char *row, unsigned char *filtered
+) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        filter_row(image, above_row, row, filter, filtered);
+        for (size_t i = 0; i < rowbytes; i++) {
+            uint32_t *frequency = &analysis->original_frequency[filter][filtered[i]];
+            *frequency += (*frequency != UINT32_MAX);
+        }
+    }
+}
+
+pngloss_error optimize_state_init(
+    optimize_state *state, pngloss_image *image,
+    const image_analysis *analysis
+) {
+    pngloss_error retval = optimize_state_alloc(state, image);
+    state->analysis = analysis;
+    return retval;
+}
+
+// like optimize_state_init followed by optimize_state_copy
+pngloss_error optimize_state_clone(
+    optimize_state *to,
+    optimize_state *from,
+    pngloss_image *image
+) {
+    pngloss_error retval = optimize_state_alloc(to, image);
+    if (SUCCESS != retval) {
+        return retval;
+    }
+    to->analysis = from->analysis;
+    optimize_state_copy(to, from, image);
+
     return SUCCESS;
 }
 
@@ -89,9 +246,6 @@ void optimize_state_destroy(optimize_state *state) {
     free(state->pixels);
     free(state->color_error);
     free(state->symbol_frequency);
-    for (uint_fast8_t filter = 0; filter < 5; filter++) {
-        free(state->original_frequency[filter]);
-    }
 }
 
 void optimize_state_copy(
@@ -101,62 +255,555 @@ void optimize_state_copy(
 ) {
     to->x = from->x;
     to->y = from->y;
+    to->error_source = NULL;
 
     memcpy(to->pixels, from->pixels, (size_t)image->width * image->bytes_per_pixel);
 
     uint32_t error_width = image->width + dither_filter_width;
     memcpy(to->color_error, from->color_error, (size_t)dither_row_count * error_width * sizeof(color_delta));
+    to->error_row = from->error_row;
 
     memcpy(to->symbol_frequency, from->symbol_frequency, (size_t)symbol_count * sizeof(uint32_t));
     to->symbol_count = from->symbol_count;
 }
 
-uintmax_t optimize_state_run(
+// Starts a trial of the next row from state. The trial overwrites every
+// pixel, so those aren't copied, and color error is copied in blocks just
+// ahead of the dither filter. A trial that is discarded early only pays for
+// the columns it reached.
+void optimize_state_begin_trial(optimize_state *trial, optimize_state *state) {
+    trial->x = state->x;
+    trial->y = state->y;
+
+    trial->error_source = state->color_error;
+    trial->error_columns = 0;
+    trial->error_row = state->error_row;
+    trial->row_symbol_end = 0;
+
+    memcpy(trial->symbol_frequency, state->symbol_frequency, (size_t)symbol_count * sizeof(uint32_t));
+    trial->symbol_count = state->symbol_count;
+}
+
+// Copy color error from the trial's source up to but not including column,
+// for dither rows first_row and below. Both share the same ring order, so
+// each row slot is copied to the same slot.
+static void optimize_state_fetch_error(
+    optimize_state *state, pngloss_image *image, uint32_t column,
+    uint_fast8_t first_row
+) {
+    uint32_t error_width = image->width + dither_filter_width;
+    if (column > error_width) {
+        column = error_width;
+    }
+    uint32_t start = state->error_columns;
+    if (start < column) {
+        for (uint_fast8_t row = first_row; row < dither_row_count; row++) {
+            size_t slot = (size_t)((state->error_row + row) % dither_row_count) * error_width;
+            memcpy(
+                state->color_error + slot + start,
+                state->error_source + slot + start,
+                (size_t)(column - start) * sizeof(color_delta)
+            );
+        }
+        state->error_columns = column;
+    }
+    if (column == error_width) {
+        state->error_source = NULL;
+    }
+}
+
+// Makes a finished trial the current state by trading buffers with it
+// instead of copying them. The trial's buffers are left with stale data,
+// which the next optimize_state_begin_trial doesn't depend on.
+void optimize_state_commit(optimize_state *state, optimize_state *trial) {
+    unsigned char *pixels = state->pixels;
+    color_delta *color_error = state->color_error;
+    uint32_t *symbol_frequency = state->symbol_frequency;
+
+    state->x = trial->x;
+    state->y = trial->y;
+    state->pixels = trial->pixels;
+    state->color_error = trial->color_error;
+    state->error_row = trial->error_row;
+    state->symbol_frequency = trial->symbol_frequency;
+    state->symbol_count = trial->symbol_count;
+
+    trial->pixels = pixels;
+    trial->color_error = color_error;
+    trial->symbol_frequency = symbol_frequency;
+}
+
+static always_inline unsigned char predict(
+    pngloss_image *image, uint32_t x, uint32_t y, pngloss_filter filter,
+    uint_fast8_t bytes_per_pixel, uint_fast8_t c, unsigned char left
+) {
+    size_t offset = (size_t)x * bytes_per_pixel + c;
+    unsigned char above = 0, diag = 0;
+    if (y > 0) {
+        above = image->rows[y-1][offset];
+        if (x > 0) {
+            diag = image->rows[y-1][offset-bytes_per_pixel];
+        }
+    }
+
+    switch (filter) {
+    case pngloss_sub:
+        return pngloss_filter_sub(above, diag, left);
+    case pngloss_up:
+        return pngloss_filter_up(above, diag, left);
+    case pngloss_average:
+        return pngloss_filter_average(above, diag, left);
+    case pngloss_paeth:
+        return pngloss_filter_paeth(above, diag, left);
+    default:
+        return pngloss_filter_none(above, diag, left);
+    }
+}
+
+static always_inline color_delta *error_row(
+    optimize_state *state, pngloss_image *image, uint_fast8_t row
+) {
+    uint32_t error_width = image->width + dither_filter_width;
+    return state->color_error + (size_t)((state->error_row + row) % dither_row_count) * error_width;
+}
+
+// Dividing magnitudes below 2^16 by a divisor below 2^15 is exact as a
+// multiply by this and a shift right by 31.
+static uint32_t bleed_reciprocal(int_fast16_t bleed_divider) {
+    return (uint32_t)(((uint64_t)1 << 31) / bleed_divider + 1);
+}
+
+#if defined(__SSE2__)
+static always_inline __m128i divide_epu32(__m128i n, __m128i reciprocal) {
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(n, reciprocal), 31);
+    __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(n, 32), reciprocal), 31);
+    return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+static always_inline void add_error(color_delta *target, __m128i error) {
+    __m128i sum = _mm_add_epi16(_mm_loadl_epi64((__m128i *)target), error);
+    _mm_storel_epi64((__m128i *)target, sum);
+}
+
+// all four channels are split at once as magnitudes
+static always_inline void diffuse_channels_sse2(
+    color_delta *rows[3], color_delta difference, uint32_t reciprocal
+) {
+    // sierra dithering
+    __m128i d = _mm_loadl_epi64((__m128i *)difference);
+    d = _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+    __m128i sign = _mm_srai_epi32(d, 31);
+    __m128i n = _mm_sub_epi32(_mm_xor_si128(d, sign), sign);
+
+    // reduce color bleed
+    n = divide_epu32(n, _mm_set1_epi32(reciprocal));
+
+    __m128i twos = _mm_srli_epi32(n, 4);
+    n = _mm_sub_epi32(n, _mm_slli_epi32(twos, 2));
+    __m128i threes = _mm_srli_epi32(n, 3);
+    n = _mm_sub_epi32(n, _mm_slli_epi32(threes, 1));
+    __m128i fours = divide_epu32(_mm_slli_epi32(n, 1), _mm_set1_epi32(((uint32_t)1 << 31) / 9 + 1));
+    n = _mm_sub_epi32(n, _mm_slli_epi32(fours, 1));
+    __m128i five = _mm_srli_epi32(n, 1);
+    n = _mm_sub_epi32(n, five);
+
+    // every share fits in 16 bits again
+    twos = _mm_sub_epi32(_mm_xor_si128(twos, sign), sign);
+    twos = _mm_packs_epi32(twos, twos);
+    threes = _mm_sub_epi32(_mm_xor_si128(threes, sign), sign);
+    threes = _mm_packs_epi32(threes, threes);
+    fours = _mm_sub_epi32(_mm_xor_si128(fours, sign), sign);
+    fours = _mm_packs_epi32(fours, fours);
+    five = _mm_sub_epi32(_mm_xor_si128(five, sign), sign);
+    five = _mm_packs_epi32(five, five);
+    n = _mm_sub_epi32(_mm_xor_si128(n, sign), sign);
+    n = _mm_packs_epi32(n, n);
+
+    add_error(&rows[1][0], twos);
+    add_error(&rows[1][4], twos);
+    add_error(&rows[2][1], twos);
+    add_error(&rows[2][3], twos);
+    add_error(&rows[0][4], threes);
+    add_error(&rows[2][2], threes);
+    add_error(&rows[1][1], fours);
+    add_error(&rows[1][3], fours);
+    add_error(&rows[1][2], five);
+    add_error(&rows[0][3], n);
+}
+#endif
+
+// Spreads the error of the pixel at state->x to its neighbors. Every step
+// rounds toward zero, so each share of a negative error is the negated
+// share of its magnitude. The simd version splits all four channels at
+// once. Gray and RGB pixels have no alpha error to spread, so their
+// callers can pass 3 channels instead of 4.
+static always_inline void diffuse_channels(
+    optimize_state *state, pngloss_image *image,
+    color_delta difference, uint32_t reciprocal, uint_fast8_t channels,
+    bool simd
+) {
+    color_delta *rows[3];
+    for (uint_fast8_t row = 0; row < dither_row_count; row++) {
+        rows[row] = error_row(state, image, row) + state->x;
+    }
+
+#if defined(__SSE2__)
+    if (simd) {
+        diffuse_channels_sse2(rows, difference, reciprocal);
+        return;
+    }
+#else
+#pragma unused(simd)
+#endif
+    // counts color delta channels and not pixel channels
+    for (uint_fast8_t c = 0; c < channels; c++) {
+        int_fast16_t d = difference[c];
+
+        // reduce color bleed
+        uint32_t magnitude = d < 0 ? -d : d;
+        magnitude = ((uint64_t)magnitude * reciprocal) >> 31;
+        d = d < 0 ? -(int_fast16_t)magnitude : (int_fast16_t)magnitude;
+
+        /*
+        // floyd-steinberg dithering
+        int_fast16_t one = d / 16;
+        d -= one;
+        rows[1][3][c] += one;
+
+        int_fast16_t three = d / 5;
+        d -= three;
+        rows[1][1][c] += three;
+
+        int_fast16_t five = d * 5/12;
+        d -= five;
+        rows[1][2][c] += five;
+
+        int_fast16_t seven = d;
+        rows[0][3][c] += seven;
+        */
+
+        /*
+        // two-row sierra dithering
+        int_fast16_t ones = d / 16;
+        d -= ones * 2;
+        rows[1][0][c] += ones;
+        rows[1][4][c] += ones;
+
+        //int_fast16_t twos = d / 8;
+        int_fast16_t twos = d / 7;
+        d -= twos * 2;
+        rows[1][1][c] += twos;
+        rows[1][3][c] += twos;
+
+        //int_fast16_t threes = d * 3/16;
+        int_fast16_t threes = d * 3/10;
+        d -= threes * 2;
+        rows[1][2][c] += threes;
+        rows[0][4][c] += threes;
+
+        //int_fast16_t four = d / 4;
+        int_fast16_t four = d;
+        rows[0][3][c] += four;
+        */
+
+        // sierra dithering
+        int_fast16_t twos = d / 16;
+        d -= twos * 4;
+        rows[1][0][c] += twos;
+        rows[1][4][c] += twos;
+        rows[2][1][c] += twos;
+        rows[2][3][c] += twos;
+
+        int_fast16_t threes = d / 8;
+        d -= threes * 2;
+        rows[0][4][c] += threes;
+        rows[2][2][c] += threes;
+
+        int_fast16_t fours = d * 2/9;
+        d -= fours * 2;
+        rows[1][1][c] += fours;
+        rows[1][3][c] += fours;
+
+        int_fast16_t five = d / 2;
+        d -= five;
+        rows[1][2][c] += five;
+
+        rows[0][3][c] += d;
+
+        /*
+        // sierra dithering, reduced color bleed
+        int_fast16_t twos = d / 16;
+        rows[1][0][c] += twos;
+        rows[1][4][c] += twos;
+        rows[2][1][c] += twos;
+        rows[2][3][c] += twos;
+
+        int_fast16_t threes = d * 3 / 32;
+        rows[0][4][c] += threes;
+        rows[3][2][c] += threes;
+
+        int_fast16_t fours = d / 8;
+        rows[1][1][c] += fours;
+        rows[1][3][c] += fours;
+
+        int_fast16_t five = d * 5 / 32;
+        rows[0][3][c] += five;
+        rows[1][2][c] += five;
+        */
+    }
+}
+
+static always_inline uint64_t symbol_key(
+    optimize_state *state, pngloss_filter filter, unsigned char symbol
+) {
+    return ((uint64_t)state->symbol_frequency[symbol] << 32) | state->analysis->original_frequency[filter][symbol];
+}
+
+// The best symbol in a band is the one seen most often so far, then the one
+// most common in the original image under this filter. Both are packed
+// into one key per symbol, and each block of symbols keeps its highest key
+// and the first symbol that has it so that wide bands can skip whole
+// blocks. Keys only grow, so a block's best only changes to the symbol
+// just seen.
+static void build_symbol_blocks(optimize_state *state, pngloss_filter filter) {
+    for (uint_fast16_t block = 0; block < symbol_count / symbol_block_size; block++) {
+        unsigned char first = block * symbol_block_size;
+        uint64_t best_key = symbol_key(state, filter, first);
+        unsigned char best_symbol = first;
+        for (uint_fast8_t i = 1; i < symbol_block_size; i++) {
+            uint64_t key = symbol_key(state, filter, first + i);
+            if (best_key < key) {
+                best_key = key;
+                best_symbol = first + i;
+            }
+        }
+        state->block_key[block] = best_key;
+        state->block_symbol[block] = best_symbol;
+    }
+}
+
+static always_inline void update_symbol_block(
+    optimize_state *state, pngloss_filter filter, unsigned char symbol
+) {
+    uint_fast8_t block = symbol / symbol_block_size;
+    uint64_t key = symbol_key(state, filter, symbol);
+    if (state->block_key[block] < key || (state->block_key[block] == key && state->block_symbol[block] > symbol)) {
+        state->block_key[block] = key;
+        state->block_symbol[block] = symbol;
+    }
+}
+
+// Bands of quantization_strength + 1 values start at multiples of that on
+// either side of zero. Look up where the band of each small magnitude
+// starts instead of dividing for every channel.
+static void build_band_floors(optimize_state *state, uint_fast8_t quantization_strength) {
+    for (uint_fast16_t magnitude = 0; magnitude < band_floor_count; magnitude++) {
+        state->band_floor[magnitude] = magnitude - (magnitude % (quantization_strength + 1));
+    }
+    state->band_strength = quantization_strength;
+}
+
+// Returns the best symbol from min to max, taking the first one in that
+// order among equals unless original_symbol is one of them. Bands never
+// span more than 256 values, so each symbol appears at most once.
+static always_inline int_fast16_t best_symbol_in_band(
+    optimize_state *state, pngloss_filter filter,
+    int_fast16_t min, int_fast16_t max, int_fast16_t original_symbol
+) {
+    if (!state->use_blocks) {
+        // compare original frequencies only between equally frequent symbols
+        int_fast16_t best_symbol = min;
+        uint32_t best_frequency = state->symbol_frequency[(unsigned char)min];
+        for (int_fast16_t symbol = min + 1; symbol <= max; symbol++) {
+            uint32_t frequency = state->symbol_frequency[(unsigned char)symbol];
+            if (best_frequency < frequency) {
+                best_frequency = frequency;
+                best_symbol = symbol;
+            } else if (best_frequency == frequency) {
+                uint32_t best_close_freq = state->analysis->original_frequency[filter][(unsigned char)best_symbol];
+                uint32_t close_freq = state->analysis->original_frequency[filter][(unsigned char)symbol];
+                if (best_close_freq < close_freq || (best_close_freq == close_freq && symbol == original_symbol)) {
+                    best_symbol = symbol;
+                }
+            }
+        }
+        return best_symbol;
+    }
+
+    uint_fast16_t count = max - min + 1;
+    unsigned char start = min;
+    uint64_t best_key = symbol_key(state, filter, start);
+    uint_fast16_t best_offset = 0;
+    uint_fast16_t offset = 1;
+    while (offset < count) {
+        unsigned char symbol = start + offset;
+        if (symbol % symbol_block_size == 0 && offset + symbol_block_size <= count) {
+            uint_fast8_t block = symbol / symbol_block_size;
+            if (best_key < state->block_key[block]) {
+                best_key = state->block_key[block];
+                best_offset = (unsigned char)(state->block_symbol[block] - start);
+            }
+            offset += symbol_block_size;
+        } else {
+            uint64_t key = symbol_key(state, filter, symbol);
+            if (best_key < key) {
+                best_key = key;
+                best_offset = offset;
+            }
+            offset++;
+        }
+    }
+
+    uint_fast16_t original_offset = (unsigned char)(original_symbol - min);
+    if (original_offset < count && symbol_key(state, filter, original_symbol) == best_key) {
+        best_offset = original_offset;
+    }
+    return min + best_offset;
+}
+
+// Error of one channel byte against its above, diagonal and left
+// neighbors: how much the change from the original pixel differs from the
+// change to each neighbor. A gray channel counts three times, once for
+// each of red, green and blue.
+static always_inline uint32_t byte_error(
+    optimize_state *state, pngloss_image *image, unsigned char *last_row_pixels,
+    uint_fast8_t bytes_per_pixel, size_t offset
+) {
+    unsigned char *original_row = image->rows[state->y];
+    int_fast16_t change = state->pixels[offset] - original_row[offset];
+    int_fast16_t above_change = 0, diag_change = 0, left_change = 0;
+    if (state->y > 0) {
+        unsigned char *above_row = image->rows[state->y - 1];
+        above_change = above_row[offset] - last_row_pixels[offset];
+        if (offset >= bytes_per_pixel) {
+            diag_change = above_row[offset - bytes_per_pixel] - last_row_pixels[offset - bytes_per_pixel];
+        }
+    }
+    if (offset >= bytes_per_pixel) {
+        left_change = state->pixels[offset - bytes_per_pixel] - original_row[offset - bytes_per_pixel];
+    }
+
+    int_fast32_t above = change - above_change;
+    int_fast32_t diag = change - diag_change;
+    int_fast32_t left = change - left_change;
+    uint32_t error = above * above + diag * diag + left * left;
+    if (bytes_per_pixel < 3 && offset % bytes_per_pixel == 0) {
+        error *= 3;
+    }
+    return error;
+}
+
+// Sums the error of pixels start up to but not including end of the row
+// being optimized, which must already be decided.
+static always_inline uint32_t row_error(
+    optimize_state *state, pngloss_image *image, unsigned char *last_row_pixels,
+    uint_fast8_t bytes_per_pixel, uint32_t start, uint32_t end, bool simd
+) {
+    uint32_t error = 0;
+    size_t offset = (size_t)start * bytes_per_pixel;
+    size_t end_offset = (size_t)end * bytes_per_pixel;
+    for (; offset < end_offset && offset < bytes_per_pixel; offset++) {
+        error += byte_error(state, image, last_row_pixels, bytes_per_pixel, offset);
+    }
+#if defined(__SSE2__)
+    if (simd) {
+        // 8 channels at a time as 16 bit changes, starting on a pixel boundary
+        // so that gray channels line up with their weights
+        unsigned char *original_row = image->rows[state->y];
+        unsigned char *above_row = NULL;
+        if (state->y > 0) {
+            above_row = image->rows[state->y - 1];
+        }
+        __m128i zero = _mm_setzero_si128();
+        __m128i weights = _mm_set1_epi16(1);
+        if (bytes_per_pixel == 1) {
+            weights = _mm_set1_epi16(3);
+        } else if (bytes_per_pixel == 2) {
+            weights = _mm_set1_epi32(0x00010003);
+        }
+        __m128i sum = zero;
+        for (; offset + 8 <= end_offset; offset += 8) {
+            __m128i change = _mm_sub_epi16(
+                _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(state->pixels + offset)), zero),
+                _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(original_row + offset)), zero)
+            );
+            __m128i left_change = _mm_sub_epi16(
+                _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(state->pixels + offset - bytes_per_pixel)), zero),
+                _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(original_row + offset - bytes_per_pixel)), zero)
+            );
+            __m128i above_change = zero;
+            __m128i diag_change = zero;
+            if (above_row) {
+                above_change = _mm_sub_epi16(
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(above_row + offset)), zero),
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(last_row_pixels + offset)), zero)
+                );
+                diag_change = _mm_sub_epi16(
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(above_row + offset - bytes_per_pixel)), zero),
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(last_row_pixels + offset - bytes_per_pixel)), zero)
+                );
+            }
+            __m128i above = _mm_sub_epi16(change, above_change);
+            __m128i diag = _mm_sub_epi16(change, diag_change);
+            __m128i left = _mm_sub_epi16(change, left_change);
+            __m128i squares = _mm_add_epi32(
+                _mm_add_epi32(
+                    _mm_madd_epi16(above, _mm_mullo_epi16(above, weights)),
+                    _mm_madd_epi16(diag, _mm_mullo_epi16(diag, weights))
+                ),
+                _mm_madd_epi16(left, _mm_mullo_epi16(left, weights))
+            );
+            sum = _mm_add_epi32(sum, squares);
+        }
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+        error += (uint32_t)_mm_cvtsi128_si32(sum);
+    }
+#else
+#pragma unused(simd)
+#endif
+    for (; offset < end_offset; offset++) {
+        error += byte_error(state, image, last_row_pixels, bytes_per_pixel, offset);
+    }
+    return error;
+}
+
+// The work for one pixel. It is inlined into a copy of the row loop for
+// each pixel format and filter, so the channel loops have a fixed count and
+// the filter and alpha checks fold away.
+static always_inline void run_pixel(
     optimize_state *state,
     pngloss_image *image,
-    unsigned char *last_row_pixels,
     pngloss_filter filter,
+    uint_fast8_t bytes_per_pixel,
     uint_fast8_t quantization_strength,
-    int_fast16_t bleed_divider
+    uint32_t reciprocal,
+    bool simd
 ) {
     int_fast16_t back_color[4];
     int_fast16_t here_color[4];
     int_fast16_t original_color[4];
-    int_fast16_t old_above_color[4];
-    int_fast16_t new_above_color[4];
-    int_fast16_t old_diag_color[4];
-    int_fast16_t new_diag_color[4];
-    int_fast16_t old_left_color[4];
-    int_fast16_t new_left_color[4];
-    for (uint_fast8_t c = 0; c < image->bytes_per_pixel; c++) {
-        uint32_t offset = state->x*image->bytes_per_pixel + c;
+
+    // diffusion below reaches dither_filter_width - 1 columns ahead, fetch
+    // the error a block at a time to keep the copies efficient
+    if (state->error_source && state->x + dither_filter_width > state->error_columns) {
+        optimize_state_fetch_error(state, image, state->x + dither_filter_width + error_fetch_columns, 0);
+    }
+
+    for (uint_fast8_t c = 0; c < bytes_per_pixel; c++) {
+        size_t offset = (size_t)state->x * bytes_per_pixel + c;
         original_color[c] = image->rows[state->y][offset];
 
         uint_fast8_t i = c;
-        unsigned char above = 0, old_above = 0, diag = 0, old_diag = 0, left = 0, old_left = 0;
-        if (state->y > 0) {
-            above = image->rows[state->y - 1][offset];
-            old_above = last_row_pixels[offset];
-            if (state->x > 0) {
-                diag = image->rows[state->y - 1][offset - image->bytes_per_pixel];
-                old_diag = last_row_pixels[offset - image->bytes_per_pixel];
-            }
-        }
+        unsigned char left = 0;
         if (state->x > 0) {
-            left = state->pixels[offset - image->bytes_per_pixel];
-            old_left = image->rows[state->y][offset - image->bytes_per_pixel];
+            left = state->pixels[offset - bytes_per_pixel];
         }
-        old_above_color[c] = old_above;
-        new_above_color[c] = above;
-        old_diag_color[c] = old_diag;
-        new_diag_color[c] = diag;
-        old_left_color[c] = old_left;
-        new_left_color[c] = left;
 
         unsigned char best_symbol;
-        int_fast16_t predicted = filter_predict(image, state->x, state->y, filter, c, left);
-        if ((image->bytes_per_pixel % 2) == 0 && image->rows[state->y][state->x*image->bytes_per_pixel+image->bytes_per_pixel-1] == 0 && c == image->bytes_per_pixel - 1) {
-        //if ((image->bytes_per_pixel % 2) == 0 && image->rows[state->y][state->x*image->bytes_per_pixel+image->bytes_per_pixel-1] == 0) {
+        int_fast16_t predicted = predict(image, state->x, state->y, filter, bytes_per_pixel, c, left);
+        if ((bytes_per_pixel % 2) == 0 && image->rows[state->y][offset - c + bytes_per_pixel - 1] == 0 && c == bytes_per_pixel - 1) {
+        //if ((bytes_per_pixel % 2) == 0 && image->rows[state->y][state->x*bytes_per_pixel+bytes_per_pixel-1] == 0) {
             // leave fully transparent pixels fully transparent, symbol
             // is expensive but artifacts are unacceptable otherwise
             here_color[c] = 0;
@@ -164,12 +811,12 @@ uintmax_t optimize_state_run(
             best_symbol = 0 - predicted;
         } else {
             // convert from pixel index to color delta index
-            if (image->bytes_per_pixel == 2 && c == 1) {
+            if (bytes_per_pixel == 2 && c == 1) {
                 // pixel alpha and color delta alpha are at different
                 // indexes when colorspace is gray+alpha
                 i = 3;
             }
-            int_fast16_t color_error = state->color_error[state->x+dither_filter_width/2][i];
+            int_fast16_t color_error = error_row(state, image, 0)[state->x+dither_filter_width/2][i];
             here_color[c] = original_color[c] + color_error;
 
             int_fast16_t original_symbol = original_color[c] - predicted;
@@ -184,11 +831,18 @@ uintmax_t optimize_state_run(
 
             // Find assigned band of values for filtered.
             int_fast16_t min, max;
+            int_fast16_t magnitude = filtered < 0 ? -filtered : filtered;
+            int_fast16_t band_floor;
+            if ((uint_fast16_t)magnitude < band_floor_count) {
+                band_floor = state->band_floor[magnitude];
+            } else {
+                band_floor = magnitude - (magnitude % (quantization_strength + 1));
+            }
             if (filtered < 0) {
-                max = -(-filtered - (-filtered % (quantization_strength + 1)));
+                max = -band_floor;
                 min = max - quantization_strength;
             } else {
-                min = filtered - (filtered % (quantization_strength + 1));
+                min = band_floor;
                 max = min + quantization_strength;
             }
                 
@@ -208,108 +862,124 @@ uintmax_t optimize_state_run(
                     max = 0 - predicted;
                 }
             }
-
-            bool found_best = false;
-            uint32_t best_frequency = 0;
-            for (int_fast16_t symbol = min; symbol <= max; symbol++) {
-                int_fast16_t back = symbol + predicted;
-                if (back < 0 || back > 255) {
-                    fprintf(stderr, "back %d min %d max %d\n", (int)back, (int)min, (int)max);
-                    abort();
-                }
-                bool new_best = false;
-                uint32_t frequency = state->symbol_frequency[(unsigned char)symbol];
-
-                if (!found_best) {
-                    new_best = true;
-                } else if (best_frequency < frequency) {
-                    new_best = true;
-                } else if (best_frequency == frequency) {
-                    uint32_t best_close_freq = state->original_frequency[filter][best_symbol];
-                    uint32_t close_freq = state->original_frequency[filter][(unsigned char)symbol];
-                    if (best_close_freq < close_freq) {
-                        new_best = true;
-                    } else if (best_close_freq == close_freq) {
-                        if (symbol == original_symbol) {
-                            new_best = true;
-                        }
-                    }
-                }
-                if (new_best) {
-                    found_best = true;
-                    best_frequency = frequency;
-                    best_symbol = symbol;
-                    back_color[c] = back;
-                }
+            if (max < min) {
+                // should be impossible, fail the row rather than the process
+                state->failed = true;
+                max = min;
             }
-            if (!found_best) {
-                fprintf(stderr, "color %d min %d max %d\n", (int)back_color[c], (int)min, (int)max);
-                abort();
+
+            int_fast16_t symbol = best_symbol_in_band(state, filter, min, max, original_symbol);
+            int_fast16_t back = symbol + predicted;
+            if (back < 0 || back > 255) {
+                state->failed = true;
+                back = back < 0 ? 0 : 255;
             }
+            best_symbol = symbol;
+            back_color[c] = back;
         }
 
         state->pixels[offset] = back_color[c];
 
-        state->symbol_frequency[best_symbol]++;
+        // saturate rather than wrap on bands of more than 4G symbols
+        state->symbol_frequency[best_symbol] += (state->symbol_frequency[best_symbol] != UINT32_MAX);
         state->symbol_count++;
+        if (state->use_blocks) {
+            update_symbol_block(state, filter, best_symbol);
+        }
+
+        if (state->row_symbol_end) {
+            // by the end of the row this symbol can't have been seen more
+            // often than it has now plus the number of symbols still to come
+            uintmax_t most_frequency = state->symbol_frequency[best_symbol] + (state->row_symbol_end - state->symbol_count);
+            state->cost_floor += ulog2(UINTMAX_MAX / most_frequency);
+        }
     }
 
     // spread color error from this pixel to nearby pixels
     color_delta difference;
-    color_difference(image->bytes_per_pixel, difference, back_color, here_color);
-    diffuse_color_error(state, image, difference, bleed_divider);
+    color_difference(bytes_per_pixel, difference, back_color, here_color);
+    diffuse_channels(state, image, difference, reciprocal, (bytes_per_pixel % 2) ? 3 : 4, simd);
 
     // advance to next pixel
     state->x++;
-
-    // calculate derivative error from three neighboring pixels to weight row cost
-    color_delta old_partial_above, new_partial_above;
-    color_difference(image->bytes_per_pixel, old_partial_above, original_color, old_above_color);
-    color_difference(image->bytes_per_pixel, new_partial_above, back_color, new_above_color);
-    color_d2 d2_above;
-    color_delta_difference(new_partial_above, old_partial_above, d2_above);
-    uint32_t above_error = color_delta_distance(d2_above);
-
-    color_delta old_partial_diag, new_partial_diag;
-    color_difference(image->bytes_per_pixel, old_partial_diag, original_color, old_diag_color);
-    color_difference(image->bytes_per_pixel, new_partial_diag, back_color, new_diag_color);
-    color_d2 d2_diag;
-    color_delta_difference(new_partial_diag, old_partial_diag, d2_diag);
-    uint32_t diag_error = color_delta_distance(d2_diag);
-
-    color_delta old_partial_left, new_partial_left;
-    color_difference(image->bytes_per_pixel, old_partial_left, original_color, old_left_color);
-    color_difference(image->bytes_per_pixel, new_partial_left, back_color, new_left_color);
-    color_d2 d2_left;
-    color_delta_difference(new_partial_left, old_partial_left, d2_left);
-    uint32_t left_error = color_delta_distance(d2_left);
-
-    uintmax_t total_error = (uintmax_t)above_error + diag_error + left_error;
-
-    return total_error;
 }
 
-uintmax_t optimize_state_row(
+static always_inline uintmax_t run_row(
     optimize_state *state,
     pngloss_image *image,
     unsigned char *last_row_pixels,
     pngloss_filter filter,
+    uint_fast8_t bytes_per_pixel,
     uint_fast8_t quantization_strength,
     int_fast16_t bleed_divider,
-    bool adaptive
+    bool adaptive,
+    uintmax_t cost_bound,
+    bool simd
 ) {
+    // A symbol's cost depends on how often it has been seen by the end of
+    // the row, which is at most how often it has been seen so far plus the
+    // number of symbols left in the row. That puts a floor under the cost of
+    // the row before it is finished. Once the error so far plus that floor
+    // reaches cost_bound the row can't win, so give up early. The filter
+    // that is chosen is the same as if the row had been finished.
+    uintmax_t row_symbols = (uintmax_t)image->width * bytes_per_pixel;
+    uintmax_t row_symbol_end = state->symbol_count + row_symbols;
+    uint_fast8_t unseen_cost = ulog2(UINTMAX_MAX / row_symbol_end);
+    if ((uintmax_t)row_symbols * unseen_cost >= cost_bound) {
+        return UINTMAX_MAX;
+    }
+    state->row_symbol_end = 0;
+    if (UINTMAX_MAX != cost_bound) {
+        state->row_symbol_end = row_symbol_end;
+    }
+    state->cost_floor = 0;
+    state->failed = false;
+
+    // narrow bands rarely cover a whole block, so don't keep them up to date
+    state->use_blocks = (quantization_strength + 1 >= 2 * symbol_block_size);
+    if (state->use_blocks) {
+        build_symbol_blocks(state, filter);
+    }
+    if (state->band_strength != quantization_strength) {
+        build_band_floors(state, quantization_strength);
+    }
+
+    uint32_t reciprocal = bleed_reciprocal(bleed_divider);
     uintmax_t total_error = 0;
     while (state->x < image->width) {
-        uintmax_t error = optimize_state_run(
-            state,
-            image,
-            last_row_pixels,
-            filter,
-            quantization_strength,
-            bleed_divider
-        );
-        total_error += error;
+        // Decide a block of pixels, then add up their error in one sweep.
+        // The bound below only grows from pixel to pixel, so checking it
+        // once a block gives up on the same rows as checking every pixel.
+        uint32_t start = state->x;
+        uint32_t end = start + error_block_pixels;
+        if (end > image->width) {
+            end = image->width;
+        }
+        while (state->x < end) {
+            run_pixel(
+                state,
+                image,
+                filter,
+                bytes_per_pixel,
+                quantization_strength,
+                reciprocal,
+                simd
+            );
+        }
+        total_error += row_error(state, image, last_row_pixels, bytes_per_pixel, start, end, simd);
+        if (state->failed) {
+            state->row_symbol_end = 0;
+            return UINTMAX_MAX;
+        }
+        if (state->row_symbol_end) {
+            uintmax_t unseen = row_symbol_end - state->symbol_count;
+            if (total_error / 128 + state->cost_floor + unseen * unseen_cost >= cost_bound) {
+                state->row_symbol_end = 0;
+                return UINTMAX_MAX;
+            }
+        }
     }
+    state->row_symbol_end = 0;
 
     unsigned char *above_row = NULL;
     if (state->y > 0) {
@@ -323,15 +993,15 @@ uintmax_t optimize_state_row(
         }
     }
 
-    uint32_t total_cost = 0;
+    uintmax_t total_cost = 0;
     for (uint32_t x = 0; x < image->width; x++) {
-        for (uint_fast8_t c = 0; c < image->bytes_per_pixel; c++) {
-            uint32_t offset = x * image->bytes_per_pixel + c;
+        for (uint_fast8_t c = 0; c < bytes_per_pixel; c++) {
+            size_t offset = (size_t)x * bytes_per_pixel + c;
             unsigned char left = 0;
             if (x > 0) {
-                left = state->pixels[offset - image->bytes_per_pixel];
+                left = state->pixels[offset - bytes_per_pixel];
             }
-            unsigned char predicted = filter_predict(image, x, state->y, filter, c, left);
+            unsigned char predicted = predict(image, x, state->y, filter, bytes_per_pixel, c, left);
             unsigned char symbol = state->pixels[offset] - predicted;
             uint32_t frequency = state->symbol_frequency[symbol];
             if (frequency) {
@@ -341,14 +1011,15 @@ uintmax_t optimize_state_row(
         }
     }
 
-    // move color errors up one row
+    // Move color errors up one row by turning the ring. This row's error
+    // is done with, so only the rows below it need the rest of the source,
+    // and its slot is cleared to become the last row.
     uint32_t error_width = image->width + dither_filter_width;
-    memmove(
-        state->color_error,
-        state->color_error + error_width,
-        (dither_row_count - 1) * error_width * sizeof(color_delta)
-    );
-    memset(state->color_error + (dither_row_count - 1) * error_width, 0, error_width * sizeof(color_delta));
+    if (state->error_source) {
+        optimize_state_fetch_error(state, image, error_width, 1);
+    }
+    memset(error_row(state, image, 0), 0, error_width * sizeof(color_delta));
+    state->error_row = (state->error_row + 1) % dither_row_count;
 
     // advance to next row and indicate success and cost to caller
     state->x = 0;
@@ -360,142 +1031,173 @@ uintmax_t optimize_state_row(
     return total_error / 128 + total_cost;
 }
 
+typedef uintmax_t (*row_kernel)(
+    optimize_state *state,
+    pngloss_image *image,
+    unsigned char *last_row_pixels,
+    uint_fast8_t quantization_strength,
+    int_fast16_t bleed_divider,
+    bool adaptive,
+    uintmax_t cost_bound
+);
+
+#define define_row_kernel(bytes_per_pixel, filter, simd, suffix) \
+    static uintmax_t run_row_##bytes_per_pixel##_##filter##suffix( \
+        optimize_state *state, \
+        pngloss_image *image, \
+        unsigned char *last_row_pixels, \
+        uint_fast8_t quantization_strength, \
+        int_fast16_t bleed_divider, \
+        bool adaptive, \
+        uintmax_t cost_bound \
+    ) { \
+        return run_row( \
+            state, image, last_row_pixels, filter, bytes_per_pixel, \
+            quantization_strength, bleed_divider, adaptive, cost_bound, simd \
+        ); \
+    }
+
+#define define_row_kernels(bytes_per_pixel, simd, suffix) \
+    define_row_kernel(bytes_per_pixel, pngloss_none, simd, suffix) \
+    define_row_kernel(bytes_per_pixel, pngloss_sub, simd, suffix) \
+    define_row_kernel(bytes_per_pixel, pngloss_up, simd, suffix) \
+    define_row_kernel(bytes_per_pixel, pngloss_average, simd, suffix) \
+    define_row_kernel(bytes_per_pixel, pngloss_paeth, simd, suffix)
+
+define_row_kernels(1, false, _scalar)
+define_row_kernels(2, false, _scalar)
+define_row_kernels(3, false, _scalar)
+define_row_kernels(4, false, _scalar)
+#if defined(__SSE2__)
+define_row_kernels(1, true, _sse2)
+define_row_kernels(2, true, _sse2)
+define_row_kernels(3, true, _sse2)
+define_row_kernels(4, true, _sse2)
+#endif
+
+#define row_kernels_for(bytes_per_pixel, suffix) { \
+    run_row_##bytes_per_pixel##_pngloss_none##suffix, \
+    run_row_##bytes_per_pixel##_pngloss_sub##suffix, \
+    run_row_##bytes_per_pixel##_pngloss_up##suffix, \
+    run_row_##bytes_per_pixel##_pngloss_average##suffix, \
+    run_row_##bytes_per_pixel##_pngloss_paeth##suffix \
+}
+
+// indexed by whether to use SSE2, bytes per pixel - 1, then filter
+static const row_kernel row_kernels[2][4][pngloss_filter_count] = {
+    {
+        row_kernels_for(1, _scalar),
+        row_kernels_for(2, _scalar),
+        row_kernels_for(3, _scalar),
+        row_kernels_for(4, _scalar)
+    },
+#if defined(__SSE2__)
+    {
+        row_kernels_for(1, _sse2),
+        row_kernels_for(2, _sse2),
+        row_kernels_for(3, _sse2),
+        row_kernels_for(4, _sse2)
+    }
+#endif
+};
+
+uintmax_t optimize_state_row(
+    optimize_state *state,
+    pngloss_image *image,
+    unsigned char *last_row_pixels,
+    pngloss_filter filter,
+    uint_fast8_t quantization_strength,
+    int_fast16_t bleed_divider,
+    bool adaptive,
+    uintmax_t cost_bound
+) {
+    bool simd = pngloss_selected_kernels() >= pngloss_kernels_sse2;
+    row_kernel kernel = row_kernels[simd][image->bytes_per_pixel - 1][filter];
+    return kernel(
+        state,
+        image,
+        last_row_pixels,
+        quantization_strength,
+        bleed_divider,
+        adaptive,
+        cost_bound
+    );
+}
+
 unsigned char filter_predict(
     pngloss_image *image, uint32_t x, uint32_t y,
     pngloss_filter filter, uint_fast8_t c, unsigned char left
 ) {
-    uint32_t offset = x*image->bytes_per_pixel + c;
-    unsigned char above = 0, diag = 0;
-    if (y > 0) {
-        above = image->rows[y-1][offset];
-        if (x > 0) {
-            diag = image->rows[y-1][offset-image->bytes_per_pixel];
-        }
-    }
-
-    unsigned char (*filter_functions[pngloss_filter_count])(
-        unsigned char, unsigned char, unsigned char
-    ) = {
-        pngloss_filter_none,
-        pngloss_filter_sub,
-        pngloss_filter_up,
-        pngloss_filter_average,
-        pngloss_filter_paeth,
-    };
-
-    unsigned char predicted = filter_functions[filter](above, diag, left);
-    return predicted;
+    return predict(image, x, y, filter, image->bytes_per_pixel, c, left);
 }
 
 void diffuse_color_error(
     optimize_state *state, pngloss_image *image,
     color_delta difference, int_fast16_t bleed_divider
 ) {
-    uint32_t error_width = image->width + dither_filter_width;
-
-    // hardcoded 4 instead of bytes_per_pixel because indexing color delta and not pixels
-    for (uint_fast8_t c = 0; c < 4; c++) {
-        int_fast16_t d = difference[c];
-
-        // reduce color bleed
-        d = d / bleed_divider;
-
-        /*
-        // floyd-steinberg dithering
-        int_fast16_t one = d / 16;
-        d -= one;
-        state->color_error[error_width + state->x + 3][c] += one;
-
-        int_fast16_t three = d / 5;
-        d -= three;
-        state->color_error[error_width + state->x + 1][c] += three;
-
-        int_fast16_t five = d * 5/12;
-        d -= five;
-        state->color_error[error_width + state->x + 2][c] += five;
-
-        int_fast16_t seven = d;
-        state->color_error[state->x + 3][c] += seven;
-        */
-
-        /*
-        // two-row sierra dithering
-        int_fast16_t ones = d / 16;
-        d -= ones * 2;
-        state->color_error[error_width + state->x + 0][c] += ones;
-        state->color_error[error_width + state->x + 4][c] += ones;
-
-        //int_fast16_t twos = d / 8;
-        int_fast16_t twos = d / 7;
-        d -= twos * 2;
-        state->color_error[error_width + state->x + 1][c] += twos;
-        state->color_error[error_width + state->x + 3][c] += twos;
-
-        //int_fast16_t threes = d * 3/16;
-        int_fast16_t threes = d * 3/10;
-        d -= threes * 2;
-        state->color_error[error_width + state->x + 2][c] += threes;
-        state->color_error[state->x + 4][c] += threes;
-
-        //int_fast16_t four = d / 4;
-        int_fast16_t four = d;
-        state->color_error[state->x + 3][c] += four;
-        */
-
-        // sierra dithering
-        int_fast16_t twos = d / 16;
-        d -= twos * 4;
-        state->color_error[error_width * 1 + state->x + 0][c] += twos;
-        state->color_error[error_width * 1 + state->x + 4][c] += twos;
-        state->color_error[error_width * 2 + state->x + 1][c] += twos;
-        state->color_error[error_width * 2 + state->x + 3][c] += twos;
-
-        int_fast16_t threes = d / 8;
-        d -= threes * 2;
-        state->color_error[error_width * 0 + state->x + 4][c] += threes;
-        state->color_error[error_width * 2 + state->x + 2][c] += threes;
-
-        int_fast16_t fours = d * 2/9;
-        d -= fours * 2;
-        state->color_error[error_width * 1 + state->x + 1][c] += fours;
-        state->color_error[error_width * 1 + state->x + 3][c] += fours;
-
-        int_fast16_t five = d / 2;
-        d -= five;
-        state->color_error[error_width * 1 + state->x + 2][c] += five;
-
-        state->color_error[error_width * 0 + state->x + 3][c] += d;
-
-        /*
-        // sierra dithering, reduced color bleed
-        int_fast16_t twos = d / 16;
-        state->color_error[error_width * 1 + state->x + 0][c] += twos;
-        state->color_error[error_width * 1 + state->x + 4][c] += twos;
-        state->color_error[error_width * 2 + state->x + 1][c] += twos;
-        state->color_error[error_width * 2 + state->x + 3][c] += twos;
-
-        int_fast16_t threes = d * 3 / 32;
-        state->color_error[error_width * 0 + state->x + 4][c] += threes;
-        state->color_error[error_width * 3 + state->x + 2][c] += threes;
+    diffuse_channels(
+        state, image, difference, bleed_reciprocal(bleed_divider), 4,
+        pngloss_selected_kernels() >= pngloss_kernels_sse2
+    );
+}
 
-        int_fast16_t fours = d / 8;
-        state->color_error[error_width * 1 + state->x + 1][c] += fours;
-        state->color_error[error_width * 1 + state->x + 3][c] += fours;
+uint32_t optimize_state_row_error(
+    optimize_state *state, pngloss_image *image, unsigned char *last_row_pixels,
+    uint32_t start, uint32_t end
+) {
+    return row_error(
+        state, image, last_row_pixels, image->bytes_per_pixel, start, end,
+        pngloss_selected_kernels() >= pngloss_kernels_sse2
+    );
+}
 
-        int_fast16_t five = d * 5 / 32;
-        state->color_error[error_width * 0 + state->x + 3][c] += five;
-        state->color_error[error_width * 1 + state->x + 2][c] += five;
-        */
+// Scalar filtering of bytes start up to but not including end of a row,
+// used where the vector versions below can't reach or aren't available.
+static void filter_row_bytes(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered, size_t start, size_t end
+) {
+    for (size_t i = start; i < end; i++) {
+        unsigned char above = 0, left = 0, diag = 0;
+        if (i >= image->bytes_per_pixel) {
+            left = pixels[i-image->bytes_per_pixel];
+            if (above_row) {
+                diag = above_row[i-image->bytes_per_pixel];
+            }
+        }
+        if (above_row) {
+            above = above_row[i];
+        }
+        unsigned char predicted;
+        switch (filter) {
+        case pngloss_sub:
+            predicted = pngloss_filter_sub(above, diag, left);
+            break;
+        case pngloss_up:
+            predicted = pngloss_filter_up(above, diag, left);
+            break;
+        case pngloss_average:
+            predicted = pngloss_filter_average(above, diag, left);
+            break;
+        case pngloss_paeth:
+            predicted = pngloss_filter_paeth(above, diag, left);
+            break;
+        default:
+            predicted = pngloss_filter_none(above, diag, left);
+            break;
+        }
+        filtered[i] = pixels[i] - predicted;
     }
 }
 
-uint_fast8_t adaptive_filter_for_rows(
-    pngloss_image *image, unsigned char *above_row, unsigned char *pixels
+static void add_filter_sums(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    uint64_t sums[pngloss_filter_count], size_t start, size_t end
 ) {
-    uint32_t none_sum = 0, sub_sum = 0, up_sum = 0;
-    uint32_t average_sum = 0, paeth_sum = 0;
+    uint64_t none_sum = 0, sub_sum = 0, up_sum = 0;
+    uint64_t average_sum = 0, paeth_sum = 0;
 
-    for (uint32_t i = 0; i < image->width * image->bytes_per_pixel; i++) {
+    for (size_t i = start; i < end; i++) {
         unsigned char above = 0, left = 0, diag = 0;
         if (i >= image->bytes_per_pixel) {
             left = pixels[i-image->bytes_per_pixel];
@@ -528,34 +1230,301 @@ uint_fast8_t adaptive_filter_for_rows(
 
         paeth_sum += (paeth < 128) ? paeth : 256 - paeth;
     }
-    uint32_t min_sum = none_sum;
-    if (min_sum > sub_sum) {
-        min_sum = sub_sum;
+    sums[pngloss_none] += none_sum;
+    sums[pngloss_sub] += sub_sum;
+    sums[pngloss_up] += up_sum;
+    sums[pngloss_average] += average_sum;
+    sums[pngloss_paeth] += paeth_sum;
+}
+
+#if defined(__SSE2__)
+// Vector versions work on 16 bytes at a time from the first byte that has a
+// left neighbor. They give exactly the same results as the scalar ones.
+
+static always_inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static always_inline __m128i abs_epi16(__m128i a) {
+    return _mm_max_epi16(a, _mm_sub_epi16(_mm_setzero_si128(), a));
+}
+
+static always_inline __m128i paeth_epi16(__m128i above, __m128i diag, __m128i left) {
+    __m128i p = _mm_sub_epi16(above, diag);
+    __m128i p_diag = _mm_sub_epi16(left, diag);
+    __m128i p_left = abs_epi16(p);
+    __m128i p_above = abs_epi16(p_diag);
+    p_diag = abs_epi16(_mm_add_epi16(p, p_diag));
+    __m128i not_left = _mm_or_si128(_mm_cmpgt_epi16(p_left, p_above), _mm_cmpgt_epi16(p_left, p_diag));
+    __m128i not_above = _mm_cmpgt_epi16(p_above, p_diag);
+    return select_si128(not_left, select_si128(not_above, diag, above), left);
+}
+
+static always_inline __m128i predict_si128(
+    pngloss_filter filter, __m128i above, __m128i diag, __m128i left
+) {
+    __m128i zero = _mm_setzero_si128();
+    switch (filter) {
+    case pngloss_sub:
+        return left;
+    case pngloss_up:
+        return above;
+    case pngloss_average:
+        // _mm_avg_epu8 rounds up, PNG rounds down
+        return _mm_sub_epi8(_mm_avg_epu8(above, left), _mm_and_si128(_mm_xor_si128(above, left), _mm_set1_epi8(1)));
+    case pngloss_paeth:
+        return _mm_packus_epi16(
+            paeth_epi16(_mm_unpacklo_epi8(above, zero), _mm_unpacklo_epi8(diag, zero), _mm_unpacklo_epi8(left, zero)),
+            paeth_epi16(_mm_unpackhi_epi8(above, zero), _mm_unpackhi_epi8(diag, zero), _mm_unpackhi_epi8(left, zero))
+        );
+    default:
+        return zero;
+    }
+}
+
+// loads the neighbors of the 16 bytes at i, which must be at least bytes_per_pixel
+static always_inline void load_neighbors(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    size_t i, __m128i *above, __m128i *diag, __m128i *left
+) {
+    *left = _mm_loadu_si128((__m128i *)(pixels + i - image->bytes_per_pixel));
+    *above = _mm_setzero_si128();
+    *diag = _mm_setzero_si128();
+    if (above_row) {
+        *above = _mm_loadu_si128((__m128i *)(above_row + i));
+        *diag = _mm_loadu_si128((__m128i *)(above_row + i - image->bytes_per_pixel));
+    }
+}
+
+// adds up filtered bytes as signed magnitudes, 256 - x for x >= 128
+static always_inline __m128i add_magnitudes(__m128i sum, __m128i filtered) {
+    __m128i negated = _mm_sub_epi8(_mm_setzero_si128(), filtered);
+    __m128i magnitude = _mm_min_epu8(filtered, negated);
+    return _mm_add_epi64(sum, _mm_sad_epu8(magnitude, _mm_setzero_si128()));
+}
+
+static always_inline uint64_t horizontal_sum(__m128i sum) {
+    uint64_t total;
+    _mm_storel_epi64((__m128i *)&total, _mm_add_epi64(sum, _mm_srli_si128(sum, 8)));
+    return total;
+}
+
+// Each vector version starts at byte i, which has a left neighbor, and
+// returns where it stopped.
+static size_t filter_row_sse2(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered, size_t i, size_t rowbytes
+) {
+    for (; i + 16 <= rowbytes; i += 16) {
+        __m128i above, diag, left;
+        load_neighbors(image, above_row, pixels, i, &above, &diag, &left);
+        __m128i here = _mm_loadu_si128((__m128i *)(pixels + i));
+        __m128i predicted = predict_si128(filter, above, diag, left);
+        _mm_storeu_si128((__m128i *)(filtered + i), _mm_sub_epi8(here, predicted));
     }
-    if (min_sum > up_sum) {
-        min_sum = up_sum;
+    return i;
+}
+
+static size_t add_filter_sums_sse2(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    uint64_t sums[pngloss_filter_count], size_t i, size_t rowbytes
+) {
+    __m128i vector_sums[pngloss_filter_count];
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        vector_sums[filter] = _mm_setzero_si128();
     }
-    if (min_sum > average_sum) {
-        min_sum = average_sum;
+    for (; i + 16 <= rowbytes; i += 16) {
+        __m128i above, diag, left;
+        load_neighbors(image, above_row, pixels, i, &above, &diag, &left);
+        __m128i here = _mm_loadu_si128((__m128i *)(pixels + i));
+        for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+            __m128i predicted = predict_si128(filter, above, diag, left);
+            vector_sums[filter] = add_magnitudes(vector_sums[filter], _mm_sub_epi8(here, predicted));
+        }
     }
-    if (min_sum > paeth_sum) {
-        min_sum = paeth_sum;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        sums[filter] += horizontal_sum(vector_sums[filter]);
     }
+    return i;
+}
+#endif
+
+#if defined(PNGLOSS_X86_DISPATCH)
+// AVX2 versions of the above, 32 bytes at a time. They are only called when
+// the CPU has AVX2, so the rest of the program still runs without it.
+#define avx2_function static always_inline __attribute__((target("avx2")))
 
-    if (min_sum >= none_sum) {
-        return pngloss_none;
+avx2_function __m256i select_si256(__m256i mask, __m256i a, __m256i b) {
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+avx2_function __m256i paeth_epi16_avx2(__m256i above, __m256i diag, __m256i left) {
+    __m256i p = _mm256_sub_epi16(above, diag);
+    __m256i p_diag = _mm256_sub_epi16(left, diag);
+    __m256i p_left = _mm256_abs_epi16(p);
+    __m256i p_above = _mm256_abs_epi16(p_diag);
+    p_diag = _mm256_abs_epi16(_mm256_add_epi16(p, p_diag));
+    __m256i not_left = _mm256_or_si256(_mm256_cmpgt_epi16(p_left, p_above), _mm256_cmpgt_epi16(p_left, p_diag));
+    __m256i not_above = _mm256_cmpgt_epi16(p_above, p_diag);
+    return select_si256(not_left, select_si256(not_above, diag, above), left);
+}
+
+avx2_function __m256i predict_si256(
+    pngloss_filter filter, __m256i above, __m256i diag, __m256i left
+) {
+    __m256i zero = _mm256_setzero_si256();
+    switch (filter) {
+    case pngloss_sub:
+        return left;
+    case pngloss_up:
+        return above;
+    case pngloss_average:
+        // _mm256_avg_epu8 rounds up, PNG rounds down
+        return _mm256_sub_epi8(_mm256_avg_epu8(above, left), _mm256_and_si256(_mm256_xor_si256(above, left), _mm256_set1_epi8(1)));
+    case pngloss_paeth:
+        // unpacking and packing both work within 128 bit lanes, so the
+        // bytes come back out in order
+        return _mm256_packus_epi16(
+            paeth_epi16_avx2(_mm256_unpacklo_epi8(above, zero), _mm256_unpacklo_epi8(diag, zero), _mm256_unpacklo_epi8(left, zero)),
+            paeth_epi16_avx2(_mm256_unpackhi_epi8(above, zero), _mm256_unpackhi_epi8(diag, zero), _mm256_unpackhi_epi8(left, zero))
+        );
+    default:
+        return zero;
     }
-    if (min_sum >= sub_sum) {
-        return pngloss_sub;
+}
+
+avx2_function void load_neighbors_avx2(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    size_t i, __m256i *above, __m256i *diag, __m256i *left
+) {
+    *left = _mm256_loadu_si256((__m256i *)(pixels + i - image->bytes_per_pixel));
+    *above = _mm256_setzero_si256();
+    *diag = _mm256_setzero_si256();
+    if (above_row) {
+        *above = _mm256_loadu_si256((__m256i *)(above_row + i));
+        *diag = _mm256_loadu_si256((__m256i *)(above_row + i - image->bytes_per_pixel));
     }
-    if (min_sum >= up_sum) {
-        return pngloss_up;
+}
+
+__attribute__((target("avx2")))
+static size_t filter_row_avx2(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered, size_t i, size_t rowbytes
+) {
+    for (; i + 32 <= rowbytes; i += 32) {
+        __m256i above, diag, left;
+        load_neighbors_avx2(image, above_row, pixels, i, &above, &diag, &left);
+        __m256i here = _mm256_loadu_si256((__m256i *)(pixels + i));
+        __m256i predicted = predict_si256(filter, above, diag, left);
+        _mm256_storeu_si256((__m256i *)(filtered + i), _mm256_sub_epi8(here, predicted));
     }
-    if (min_sum >= average_sum) {
-        return pngloss_average;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t add_filter_sums_avx2(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    uint64_t sums[pngloss_filter_count], size_t i, size_t rowbytes
+) {
+    __m256i vector_sums[pngloss_filter_count];
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        vector_sums[filter] = _mm256_setzero_si256();
+    }
+    __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= rowbytes; i += 32) {
+        __m256i above, diag, left;
+        load_neighbors_avx2(image, above_row, pixels, i, &above, &diag, &left);
+        __m256i here = _mm256_loadu_si256((__m256i *)(pixels + i));
+        for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+            __m256i filtered = _mm256_sub_epi8(here, predict_si256(filter, above, diag, left));
+            __m256i magnitude = _mm256_min_epu8(filtered, _mm256_sub_epi8(zero, filtered));
+            vector_sums[filter] = _mm256_add_epi64(vector_sums[filter], _mm256_sad_epu8(magnitude, zero));
+        }
+    }
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        __m128i sum = _mm_add_epi64(
+            _mm256_castsi256_si128(vector_sums[filter]),
+            _mm256_extracti128_si256(vector_sums[filter], 1)
+        );
+        sums[filter] += horizontal_sum(sum);
+    }
+    return i;
+}
+#endif
+
+// filters a row of pixels with one filter into filtered, which must hold
+// the row
+void filter_row(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered
+) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    size_t i = image->bytes_per_pixel;
+    // each set of kernels leaves what it can't reach to the next one down
+    switch (pngloss_selected_kernels()) {
+    case pngloss_kernels_avx2:
+#if defined(PNGLOSS_X86_DISPATCH)
+        i = filter_row_avx2(image, above_row, pixels, filter, filtered, i, rowbytes);
+#endif
+        // fall through
+    case pngloss_kernels_sse2:
+#if defined(__SSE2__)
+        i = filter_row_sse2(image, above_row, pixels, filter, filtered, i, rowbytes);
+#endif
+        // fall through
+    case pngloss_kernels_scalar:
+        break;
+    }
+    filter_row_bytes(image, above_row, pixels, filter, filtered, 0, image->bytes_per_pixel);
+    filter_row_bytes(image, above_row, pixels, filter, filtered, i, rowbytes);
+}
+
+// sums of absolute filtered values, the heuristic libpng uses to pick filters
+void filter_sums_for_rows(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    uint64_t sums[pngloss_filter_count]
+) {
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        sums[filter] = 0;
     }
-    if (min_sum >= paeth_sum) {
-        return pngloss_paeth;
+
+    size_t i = image->bytes_per_pixel;
+    switch (pngloss_selected_kernels()) {
+    case pngloss_kernels_avx2:
+#if defined(PNGLOSS_X86_DISPATCH)
+        i = add_filter_sums_avx2(image, above_row, pixels, sums, i, rowbytes);
+#endif
+        // fall through
+    case pngloss_kernels_sse2:
+#if defined(__SSE2__)
+        i = add_filter_sums_sse2(image, above_row, pixels, sums, i, rowbytes);
+#endif
+        // fall through
+    case pngloss_kernels_scalar:
+        break;
+    }
+    add_filter_sums(image, above_row, pixels, sums, 0, image->bytes_per_pixel);
+    add_filter_sums(image, above_row, pixels, sums, i, rowbytes);
+}
+
+uint_fast8_t adaptive_filter_for_rows(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels
+) {
+    uint64_t sums[pngloss_filter_count];
+    filter_sums_for_rows(image, above_row, pixels, sums);
+
+    uint64_t min_sum = sums[pngloss_none];
+    for (pngloss_filter filter = 1; filter < pngloss_filter_count; filter++) {
+        if (min_sum > sums[filter]) {
+            min_sum = sums[filter];
+        }
+    }
+
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        if (min_sum >= sums[filter]) {
+            return filter;
+        }
     }
     // unreachable
     return pngloss_filter_count;
@@ -563,6 +1532,11 @@ uint_fast8_t adaptive_filter_for_rows(
 
 // calculates floor(log2(x))
 uint_fast8_t ulog2(uintmax_t x) {
+#if defined(__GNUC__)
+    if (sizeof(x) == sizeof(unsigned long long)) {
+        return x ? (uint_fast8_t)(sizeof(x) * 8 - __builtin_clzll(x)) : 0;
+    }
+#endif
     uint_fast8_t result = 0;
     while (x) {
         x >>= 1;
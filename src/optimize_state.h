@@ -6,13 +6,31 @@
 #include "rwpng.h"
 
 // data structures
+
+// Whole-image statistics, computed once before optimizing and only read
+// after that, so every state shares one copy.
+typedef struct {
+    uint32_t original_frequency[5][256];
+} image_analysis;
+
 typedef struct {
     uint32_t x, y;
     unsigned char *pixels;
     color_delta *color_error;
     uint32_t *symbol_frequency;
     uintmax_t symbol_count;
-    uint32_t *original_frequency[5];
+    const image_analysis *analysis;
+    color_delta *error_source;
+    uint32_t error_columns;
+    uint_fast8_t error_row;
+    uintmax_t row_symbol_end;
+    uintmax_t cost_floor;
+    bool failed;
+    bool use_blocks;
+    uint64_t block_key[16];
+    unsigned char block_symbol[16];
+    uint16_t band_floor[512];
+    uint_fast16_t band_strength;
 } optimize_state;
 
 typedef enum {
@@ -25,8 +43,21 @@ typedef enum {
 } pngloss_filter;
 
 // function prototypes
+pngloss_error image_analysis_init(
+    image_analysis *analysis, pngloss_image *image, uint_fast8_t thread_count
+);
+void image_analysis_add_row(
+    image_analysis *analysis, pngloss_image *image,
+    unsigned char *above_row, unsigned char *row, unsigned char *filtered
+);
 pngloss_error optimize_state_init(
-    optimize_state *state, pngloss_image *image
+    optimize_state *state, pngloss_image *image,
+    const image_analysis *analysis
+);
+pngloss_error optimize_state_clone(
+    optimize_state *to,
+    optimize_state *from,
+    pngloss_image *image
 );
 void optimize_state_destroy(optimize_state *state);
 void optimize_state_copy(
@@ -34,14 +65,8 @@ void optimize_state_copy(
     optimize_state *from,
     pngloss_image *image
 );
-uintmax_t optimize_state_run(
-    optimize_state *state,
-    pngloss_image *image,
-    unsigned char *last_row_pixels,
-    pngloss_filter filter,
-    uint_fast8_t quantization_strength,
-    int_fast16_t bleed_divider
-);
+void optimize_state_begin_trial(optimize_state *trial, optimize_state *state);
+void optimize_state_commit(optimize_state *state, optimize_state *trial);
 uintmax_t optimize_state_row(
     optimize_state *state,
     pngloss_image *image,
@@ -49,7 +74,8 @@ uintmax_t optimize_state_row(
     pngloss_filter filter,
     uint_fast8_t quantization_strength,
     int_fast16_t bleed_divider,
-    bool adaptive
+    bool adaptive,
+    uintmax_t cost_bound
 );
 unsigned char filter_predict(
     pngloss_image *image, uint32_t x, uint32_t y,
@@ -59,6 +85,18 @@ void diffuse_color_error(
     optimize_state *state, pngloss_image *image,
     color_delta difference, int_fast16_t bleed_divider
 );
+uint32_t optimize_state_row_error(
+    optimize_state *state, pngloss_image *image, unsigned char *last_row_pixels,
+    uint32_t start, uint32_t end
+);
+void filter_row(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    pngloss_filter filter, unsigned char *filtered
+);
+void filter_sums_for_rows(
+    pngloss_image *image, unsigned char *above_row, unsigned char *pixels,
+    uint64_t sums[pngloss_filter_count]
+);
 uint_fast8_t adaptive_filter_for_rows(
     pngloss_image *image, unsigned char *above_row, unsigned char *pixels
 );
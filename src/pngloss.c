@@ -21,9 +21,12 @@
 #  include <unistd.h>
 #endif
 
+#include "cpu_dispatch.h"
 #include "pngloss_image.h"
 #include "pngloss_opts.h"
+#include "pngloss_serve.h"
 #include "rwpng.h"  /* typedefs, common macros, public prototypes */
+#include "thread_pool.h"
 
 char *PNGLOSS_USAGE = "\
 usage:  pngloss [options] -- pngfile [pngfile ...]\n\
@@ -31,6 +34,9 @@ usage:  pngloss [options] -- pngfile [pngfile ...]\n\
 options:\n\
   -s, --strength 19 how much quality to sacrifice, from 0 to 100 (default 19)\n\
   -b, --bleed 2     bleed divider, from 1 (full dithering) to 32767 (none)\n\
+  -t, --threads 1   number of threads to use per image, from 1 to 255\n\
+  -j, --jobs 1      number of files to compress at once, from 1 to 255\n\
+  -1 ... -9         effort, -1 tries one filter per row, -9 all (default)\n\
   -f, --force       overwrite existing output files\n\
   -o, --output file destination file path to use instead of --ext\n\
   -v, --verbose     print status messages\n\
@@ -39,6 +45,13 @@ options:\n\
   --skip-if-larger  only save converted files if they're smaller than original\n\
   --ext new.png     set custom suffix/extension for output filenames\n\
   --strip           remove optional metadata (default on Mac)\n\
+  --bands 1         compress this many horizontal strips independently\n\
+  --stream          hold only a few rows in memory, for very large images\n\
+  --memory-limit MB keep larger images in a scratch file instead of memory\n\
+  --trials 1        try this many zlib settings, keep the smallest (1-6)\n\
+  --parallel-deflate deflate in blocks on -t threads, output depends on -t\n\
+  --serve sock      compress requests from a Unix socket, -j of them at once\n\
+  --timeout 30      seconds a --serve request may wait or stall\n\
 \n\
 Lossily compresses a PNG by using more compressible colors that are\n\
 close enough to the original color values. The threshold determining\n\
@@ -52,18 +65,20 @@ file exists is to skip the conversion; use --force to overwrite.\n";
 
 char *PNGLOSS_VERSION = "1.0.1";
 
-static pngloss_error prepare_output_image(png24_image *input_image, rwpng_color_transform tag, png24_image *output_image);
-static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool verbose);
+static void prepare_output_image(png24_image *input_image, rwpng_color_transform tag, png24_image *output_image);
+static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool keep_file_data, bool verbose, FILE *log);
 static pngloss_error write_image(png24_image *output_image24, unsigned char *row_filters, const char *outname, struct pngloss_options *options);
+static pngloss_error open_output(const char *outname, struct pngloss_options *options, FILE **outfile_p, char **tempname_p);
+static pngloss_error close_output(FILE *outfile, char *tempname, const char *outname, struct pngloss_options *options, pngloss_error retval);
+static pngloss_error stream_file(const char *filename, const char *outname, struct pngloss_options *options);
+static void print_input_info(FILE *log, png24_image *input_image);
+static void print_output_info(FILE *log, png24_image *input_image, png24_image *output_image, pngloss_error retval);
+static pngloss_error write_original(png24_image *input_image, FILE *log);
 static char *add_filename_extension(const char *filename, const char *newext);
 static bool file_exists(const char *outname);
 
 void pngloss_internal_print_config(FILE *fd) {
-    fputs(""
-        #if !USE_SSE && (defined(__SSE__) || defined(__amd64__) || defined(__X86_64__) || defined(__i386__))
-                    "   SSE acceleration disabled.\n"
-        #endif
-    , fd);
+    pngloss_print_cpu_config(fd);
     fflush(fd);
 }
 
@@ -87,15 +102,33 @@ static void print_usage(FILE *fd)
     fputs(PNGLOSS_USAGE, fd);
 }
 
+// the library ignores a PNGLOSS_CPU it can't use without saying so
+static void warn_kernels_request(FILE *fd)
+{
+    const char *requested;
+    pngloss_kernels_request request = pngloss_selected_kernels_request(&requested);
+    const char *selected = pngloss_kernels_name(pngloss_selected_kernels());
+    if (pngloss_kernels_request_unsupported == request) {
+        fprintf(fd, "  warning: PNGLOSS_CPU=%s isn't supported here, using %s\n", requested, selected);
+    } else if (pngloss_kernels_request_unknown == request) {
+        fprintf(fd, "  warning: unknown PNGLOSS_CPU=%s, using %s (choose scalar, sse2 or avx2)\n", requested, selected);
+    }
+}
+
 pngloss_error pngloss_main_internal(struct pngloss_options *options);
-static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options);
 
 #ifndef PNGLOSS_NO_MAIN
 int main(int argc, char *argv[])
 {
     struct pngloss_options options = {
         .strength = 19,
-        .bleed_divider = 2
+        .bleed_divider = 2,
+        .threads = 1,
+        .jobs = 1,
+        .bands = 1,
+        .deflate_trials = 1,
+        .timeout = 30,
+        .level = 9
     };
 
     pngloss_error retval = pngloss_parse_options(argc, argv, &options);
@@ -130,6 +163,41 @@ int main(int argc, char *argv[])
         return INVALID_ARGUMENT;
     }
 
+    if (options.threads < 1 || options.threads > 255) {
+        fputs("Must specify a thread count in the range 1-255.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.jobs < 1 || options.jobs > 255) {
+        fputs("Must specify a job count in the range 1-255.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.bands < 1 || options.bands > 65535) {
+        fputs("Must specify a band count in the range 1-65535.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.deflate_trials < 1 || options.deflate_trials > RWPNG_DEFLATE_TRIALS_MAX) {
+        fprintf(stderr, "Must specify a deflate trial count in the range 1-%d.\n", RWPNG_DEFLATE_TRIALS_MAX);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.timeout < 1) {
+        fputs("Must specify a timeout of at least 1 second.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    warn_kernels_request(stderr);
+
+    if (options.serve_path) {
+        if (options.num_files || options.using_stdin) {
+            fputs("--serve doesn't take input files\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        return pngloss_serve(&options);
+    }
+
     if (options.extension && options.output_file_path) {
         fputs("--ext and --output options can't be used at the same time\n", stderr);
         return INVALID_ARGUMENT;
@@ -164,35 +232,387 @@ int main(int argc, char *argv[])
 }
 #endif
 
-// Don't use this. This is not a public API.
-pngloss_error pngloss_main_internal(struct pngloss_options *options)
+// One file on its way through the read, optimize and write stages.
+typedef struct {
+    struct pngloss_options options;
+    const char *filename;
+    const char *outname;
+    char *outname_free;
+    png24_image input_image, output_image;
+    unsigned char *row_filters;
+    size_t pixel_bytes;
+    pngloss_error retval;
+    bool finished;
+    char *messages;
+    size_t messages_size;
+} file_task;
+
+// Sends this file's messages to a private stream instead of stderr, so they
+// can be printed in one piece once the file is done.
+static pngloss_error file_task_capture_log(file_task *task)
 {
-    unsigned int error_count = 0, skipped_count = 0, file_count = 0;
-    pngloss_error latest_error = SUCCESS;
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    task->options.log = tmpfile();
+#else
+    task->options.log = open_memstream(&task->messages, &task->messages_size);
+#endif
+    return task->options.log ? SUCCESS : OUT_OF_MEMORY_ERROR;
+}
 
-    for (unsigned int i = 0; i < options->num_files; i++) {
-        const char *filename = options->using_stdin ? "stdin" : options->files[i];
-        struct pngloss_options opts = *options;
-        pngloss_error retval = SUCCESS;
-
-        const char *outname = opts.output_file_path;
-        char *outname_free = NULL;
-        if (!opts.using_stdout) {
-            if (!outname) {
-                outname = outname_free = add_filename_extension(filename, opts.extension);
+static void file_task_print_log(file_task *task, pthread_mutex_t *log_mutex)
+{
+    FILE *log = task->options.log;
+    if (!log || stderr == log) {
+        return;
+    }
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+    task->messages_size = ftell(log);
+    task->messages = malloc(task->messages_size);
+    rewind(log);
+    if (task->messages) {
+        task->messages_size = fread(task->messages, 1, task->messages_size, log);
+    }
+#endif
+    fclose(log);
+    task->options.log = NULL;
+
+    if (task->messages && task->messages_size) {
+        pthread_mutex_lock(log_mutex);
+        fwrite(task->messages, 1, task->messages_size, stderr);
+        fflush(stderr);
+        pthread_mutex_unlock(log_mutex);
+    }
+    free(task->messages);
+    task->messages = NULL;
+}
+
+// Reads the image into memory, or does all of the work when it's streamed.
+static void file_task_read(file_task *task, struct pngloss_options *options, unsigned int i)
+{
+    struct pngloss_options *opts = &task->options;
+    FILE *log = opts->log;
+    *opts = *options;
+    opts->log = log;
+
+    task->filename = options->using_stdin ? "stdin" : options->files[i];
+    task->outname = opts->output_file_path;
+    if (!opts->using_stdout) {
+        if (!task->outname) {
+            task->outname = task->outname_free = add_filename_extension(task->filename, opts->extension);
+        }
+        if (!opts->force && file_exists(task->outname)) {
+            fprintf(log, "  error: '%s' exists; not overwriting\n", task->outname);
+            task->retval = NOT_OVERWRITING_ERROR;
+            task->finished = true;
+            return;
+        }
+    }
+
+    if (opts->verbose) {
+        fprintf(log, "%s:\n", task->filename);
+    }
+
+    if (opts->stream && !opts->using_stdin) {
+        task->retval = stream_file(task->filename, task->outname, opts);
+        if (NOT_STREAMABLE != task->retval) {
+            task->finished = true;
+            return;
+        }
+        if (opts->verbose) {
+            fprintf(log, "  can't stream this image, reading it whole\n");
+        }
+        task->retval = SUCCESS;
+    }
+
+    // The original is only needed again in place of a result that is too
+    // large for stdout. The file as read is much smaller than its pixels,
+    // so keep that and optimize the decoded pixels in place.
+    bool keep_file_data = opts->using_stdout && opts->skip_if_larger;
+    png24_image *input_image = &task->input_image;
+    if (opts->memory_limit) {
+        // in decimal megabytes, like the sizes reported in KB
+        input_image->spill_size = opts->memory_limit < SIZE_MAX / 1000000 ? opts->memory_limit * 1000000 : SIZE_MAX;
+    }
+    task->retval = read_image(task->filename, opts->using_stdin, input_image, opts->strip, keep_file_data, opts->verbose, log);
+
+    if (SUCCESS == task->retval && opts->verbose) {
+        print_input_info(log, input_image);
+    }
+
+    if (SUCCESS == task->retval) {
+        prepare_output_image(input_image, input_image->output_color, &task->output_image);
+        task->pixel_bytes = (size_t)input_image->height * input_image->width * input_image->bytes_per_pixel;
+    }
+
+    // not necessary to check return value because NULL row_filters is valid;
+    // cleared so that rows never reached by a failed optimization read as none
+    task->row_filters = calloc(input_image->height, 1);
+}
+
+static void file_task_optimize(file_task *task)
+{
+    if (task->finished || SUCCESS != task->retval) {
+        return;
+    }
+
+    png24_image *output_image = &task->output_image;
+    pngloss_image image = {
+        .rows = output_image->row_pointers,
+        .width = output_image->width,
+        .height = output_image->height,
+        .bytes_per_pixel = output_image->bytes_per_pixel
+    };
+    struct pngloss_options *opts = &task->options;
+    task->retval = optimize_image(&image, task->row_filters, opts->verbose && opts->log == stderr, opts->strength, opts->bleed_divider, opts->threads, opts->bands, opts->level, NULL);
+}
+
+static pngloss_error file_task_write(file_task *task)
+{
+    struct pngloss_options *opts = &task->options;
+    png24_image *input_image = &task->input_image;
+    png24_image *output_image = &task->output_image;
+
+    if (!task->finished && SUCCESS == task->retval) {
+        if (opts->skip_if_larger) {
+            output_image->maximum_file_size = input_image->file_size - 1;
+        }
+
+        output_image->chunks = input_image->chunks; input_image->chunks = NULL;
+        task->retval = write_image(output_image, task->row_filters, task->outname, opts);
+
+        if (opts->verbose) {
+            print_output_info(opts->log, input_image, output_image, task->retval);
+        }
+    }
+
+    if (!task->finished && opts->using_stdout && (TOO_LARGE_FILE == task->retval || TOO_LOW_QUALITY == task->retval)) {
+        // when outputting to stdout it'd be nasty to create 0-byte file
+        // so if quality is too low, output the original file
+        pngloss_error write_retval = write_original(input_image, opts->log);
+        if (write_retval) {
+            task->retval = write_retval;
+        }
+    }
+
+    rwpng_free_image24(input_image);
+    rwpng_free_image24(output_image);
+    free(task->row_filters);
+    task->row_filters = NULL;
+    free(task->outname_free);
+    task->outname_free = NULL;
+
+    return task->retval;
+}
+
+static pngloss_error pngloss_file_at(struct pngloss_options *options, unsigned int i, file_task *task)
+{
+    file_task_read(task, options, i);
+    file_task_optimize(task);
+    return file_task_write(task);
+}
+
+typedef struct {
+    struct pngloss_options *options;
+    pngloss_error *results;
+    pthread_mutex_t log_mutex;
+} batch_job;
+
+static void batch_file(void *context, uint32_t index)
+{
+    batch_job *job = context;
+    file_task task = {.retval = SUCCESS};
+    if (SUCCESS != file_task_capture_log(&task)) {
+        job->results[index] = OUT_OF_MEMORY_ERROR;
+        return;
+    }
+
+    job->results[index] = pngloss_file_at(job->options, index, &task);
+    file_task_print_log(&task, &job->log_mutex);
+}
+
+// How far the reader may run ahead of the optimizer, and the writer behind
+// it. Decoded images in flight are also limited by size, but one is always
+// let through so a single huge image can't stall the pipeline.
+#define PIPELINE_DEPTH 2
+#define PIPELINE_MAX_BYTES ((size_t)256 << 20)
+
+typedef struct {
+    struct pngloss_options *options;
+    file_task *tasks;
+    unsigned int task_count;
+    unsigned int read_count, optimized_count, written_count;
+    size_t bytes_in_flight;
+    pthread_mutex_t mutex;
+    pthread_cond_t progress;
+    pthread_mutex_t log_mutex;
+} pipeline;
+
+static void *pipeline_reader(void *context)
+{
+    pipeline *p = context;
+    for (unsigned int i = 0; i < p->task_count; i++) {
+        pthread_mutex_lock(&p->mutex);
+        while (i - p->optimized_count >= PIPELINE_DEPTH ||
+               (p->bytes_in_flight && p->bytes_in_flight >= PIPELINE_MAX_BYTES)) {
+            pthread_cond_wait(&p->progress, &p->mutex);
+        }
+        pthread_mutex_unlock(&p->mutex);
+
+        file_task *task = &p->tasks[i];
+        if (SUCCESS == file_task_capture_log(task)) {
+            file_task_read(task, p->options, i);
+        } else {
+            task->retval = OUT_OF_MEMORY_ERROR;
+            task->finished = true;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        p->bytes_in_flight += task->pixel_bytes;
+        p->read_count++;
+        pthread_cond_broadcast(&p->progress);
+        pthread_mutex_unlock(&p->mutex);
+    }
+    return NULL;
+}
+
+// Writes a file once it is optimized and frees its images.
+static void pipeline_write(pipeline *p, unsigned int i)
+{
+    file_task *task = &p->tasks[i];
+    file_task_write(task);
+    file_task_print_log(task, &p->log_mutex);
+
+    pthread_mutex_lock(&p->mutex);
+    p->bytes_in_flight -= task->pixel_bytes;
+    p->written_count++;
+    pthread_cond_broadcast(&p->progress);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+static void *pipeline_writer(void *context)
+{
+    pipeline *p = context;
+    for (unsigned int i = 0; i < p->task_count; i++) {
+        pthread_mutex_lock(&p->mutex);
+        while (p->optimized_count <= i) {
+            pthread_cond_wait(&p->progress, &p->mutex);
+        }
+        pthread_mutex_unlock(&p->mutex);
+
+        pipeline_write(p, i);
+    }
+    return NULL;
+}
+
+// Reads the next file and writes the previous one while this one is being
+// optimized. Messages are still printed per file and in order.
+static pngloss_error pipeline_run(struct pngloss_options *options, pngloss_error *results)
+{
+    pipeline p = {
+        .options = options,
+        .tasks = calloc(options->num_files, sizeof(file_task)),
+        .task_count = options->num_files,
+    };
+    if (!p.tasks) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_mutex_init(&p.mutex, NULL)) {
+        free(p.tasks);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_cond_init(&p.progress, NULL)) {
+        pthread_mutex_destroy(&p.mutex);
+        free(p.tasks);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_mutex_init(&p.log_mutex, NULL)) {
+        pthread_cond_destroy(&p.progress);
+        pthread_mutex_destroy(&p.mutex);
+        free(p.tasks);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    pthread_t reader, writer;
+    pngloss_error retval = SUCCESS;
+    if (pthread_create(&reader, NULL, pipeline_reader, &p)) {
+        retval = OUT_OF_MEMORY_ERROR;
+    } else {
+        // without a writer thread each file is written right after it's optimized
+        bool has_writer = !pthread_create(&writer, NULL, pipeline_writer, &p);
+
+        for (unsigned int i = 0; i < p.task_count; i++) {
+            pthread_mutex_lock(&p.mutex);
+            while (p.read_count <= i || (has_writer && i - p.written_count >= PIPELINE_DEPTH)) {
+                pthread_cond_wait(&p.progress, &p.mutex);
             }
-            if (!opts.force && file_exists(outname)) {
-                fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
-                retval = NOT_OVERWRITING_ERROR;
+            pthread_mutex_unlock(&p.mutex);
+
+            file_task_optimize(&p.tasks[i]);
+
+            pthread_mutex_lock(&p.mutex);
+            p.optimized_count++;
+            pthread_cond_broadcast(&p.progress);
+            pthread_mutex_unlock(&p.mutex);
+
+            if (!has_writer) {
+                pipeline_write(&p, i);
             }
         }
 
-        if (SUCCESS == retval) {
-            retval = pngloss_file_internal(filename, outname, &opts);
+        pthread_join(reader, NULL);
+        if (has_writer) {
+            pthread_join(writer, NULL);
         }
 
-        free(outname_free);
+        for (unsigned int i = 0; i < p.task_count; i++) {
+            results[i] = p.tasks[i].retval;
+        }
+    }
+
+    pthread_mutex_destroy(&p.log_mutex);
+    pthread_cond_destroy(&p.progress);
+    pthread_mutex_destroy(&p.mutex);
+    free(p.tasks);
+    return retval;
+}
+
+// Don't use this. This is not a public API.
+pngloss_error pngloss_main_internal(struct pngloss_options *options)
+{
+    unsigned int error_count = 0, skipped_count = 0, file_count = 0;
+    pngloss_error latest_error = SUCCESS;
+
+    pngloss_error *results = calloc(options->num_files ? options->num_files : 1, sizeof(results[0]));
+    if (!results) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    // without the threads for a batch or a pipeline, files are done one by one
+    thread_pool pool;
+    bool batched = false;
+    if (options->jobs > 1 && options->num_files > 1 &&
+        SUCCESS == thread_pool_init(&pool, options->jobs)) {
+        batch_job job = {
+            .options = options,
+            .results = results,
+        };
+        if (!pthread_mutex_init(&job.log_mutex, NULL)) {
+            thread_pool_run(&pool, batch_file, options->num_files, &job);
+            pthread_mutex_destroy(&job.log_mutex);
+            batched = true;
+        }
+        thread_pool_destroy(&pool);
+    }
+    if (!batched && (options->num_files < 2 || options->using_stdin ||
+                     SUCCESS != pipeline_run(options, results))) {
+        for (unsigned int i = 0; i < options->num_files; i++) {
+            file_task task = {.options.log = stderr, .retval = SUCCESS};
+            results[i] = pngloss_file_at(options, i, &task);
+        }
+    }
 
+    for (unsigned int i = 0; i < options->num_files; i++) {
+        pngloss_error retval = results[i];
         if (retval) {
             latest_error = retval;
             if (retval == TOO_LOW_QUALITY || retval == TOO_LARGE_FILE) {
@@ -203,6 +623,7 @@ pngloss_error pngloss_main_internal(struct pngloss_options *options)
         }
         ++file_count;
     }
+    free(results);
 
     if (options->verbose) {
         if (error_count) {
@@ -222,85 +643,45 @@ pngloss_error pngloss_main_internal(struct pngloss_options *options)
     return latest_error;
 }
 
-// I hacked it.
-static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options) {
-    pngloss_error retval = SUCCESS;
-
-    if (options->verbose) {
-        fprintf(stderr, "%s:\n", filename);
-    }
-
-    png24_image input_image = {.width=0};
-    if (SUCCESS == retval) {
-        retval = read_image(filename, options->using_stdin, &input_image, options->strip, options->verbose);
+static void print_input_info(FILE *log, png24_image *input_image)
+{
+    fprintf(log, "  read %luKB file\n", (input_image->file_size+500UL)/1000UL);
+    if (input_image->mapped_size) {
+        fprintf(log, "  keeping %luMB of pixels in a scratch file\n", (unsigned long)((input_image->mapped_size+500000)/1000000));
     }
 
-    if (SUCCESS == retval && options->verbose) {
-        fprintf(stderr, "  read %luKB file\n", (input_image.file_size+500UL)/1000UL);
-
-        if (RWPNG_ICCP == input_image.input_color) {
-            fprintf(stderr, "  used embedded ICC profile to transform image to sRGB colorspace\n");
-        } else if (RWPNG_GAMA_CHRM == input_image.input_color) {
-            fprintf(stderr, "  used gAMA and cHRM chunks to transform image to sRGB colorspace\n");
-        } else if (RWPNG_ICCP_WARN_GRAY == input_image.input_color) {
-            fprintf(stderr, "  warning: ignored ICC profile in GRAY colorspace\n");
-        } else if (RWPNG_COCOA == input_image.input_color) {
-            // No comment
-        } else if (RWPNG_SRGB == input_image.input_color) {
-            fprintf(stderr, "  passing sRGB tag from the input\n");
-        } else if (input_image.gamma != 0.45455) {
-            fprintf(stderr, "  converted image from gamma %2.1f to gamma 2.2\n",
-                           1.0/input_image.gamma);
-        }
+    if (RWPNG_ICCP == input_image->input_color) {
+        fprintf(log, "  used embedded ICC profile to transform image to sRGB colorspace\n");
+    } else if (RWPNG_GAMA_CHRM == input_image->input_color) {
+        fprintf(log, "  used gAMA and cHRM chunks to transform image to sRGB colorspace\n");
+    } else if (RWPNG_ICCP_WARN_GRAY == input_image->input_color) {
+        fprintf(log, "  warning: ignored ICC profile in GRAY colorspace\n");
+    } else if (RWPNG_COCOA == input_image->input_color) {
+        // No comment
+    } else if (RWPNG_SRGB == input_image->input_color) {
+        fprintf(log, "  passing sRGB tag from the input\n");
+    } else if (input_image->gamma != 0.45455) {
+        fprintf(log, "  converted image from gamma %2.1f to gamma 2.2\n",
+                       1.0/input_image->gamma);
     }
+}
 
-    png24_image output_image = {.width=0};
-    if (SUCCESS == retval) {
-        retval = prepare_output_image(&input_image, input_image.output_color, &output_image);
-    }
-
-    // not necessary to check return value because NULL row_filters is valid
-    unsigned char *row_filters = malloc(input_image.height);
-
+static void print_output_info(FILE *log, png24_image *input_image, png24_image *output_image, pngloss_error retval)
+{
     if (SUCCESS == retval) {
-        optimize_with_rows(output_image.row_pointers, output_image.width, output_image.height, row_filters, options->verbose, options->strength, options->bleed_divider);
-
-        if (options->skip_if_larger) {
-            output_image.maximum_file_size = input_image.file_size - 1;
+        unsigned long kb = ((unsigned long)output_image->file_size + 500UL) / 1000UL;
+        float percent = 100.0f * (float)output_image->file_size / (float)input_image->file_size;
+        fprintf(log, "  wrote %luKB file (%.1f%% of original)\n", kb, percent);
+        if (output_image->deflate_config) {
+            fprintf(log, "  kept deflate trial with %s\n", output_image->deflate_config);
         }
-
-        output_image.chunks = input_image.chunks; input_image.chunks = NULL;
-        retval = write_image(&output_image, row_filters, outname, options);
-
-        if (options->verbose) {
-            if (SUCCESS == retval) {
-                unsigned long kb = ((unsigned long)output_image.file_size + 500UL) / 1000UL;
-                float percent = 100.0f * (float)output_image.file_size / (float)input_image.file_size;
-                fprintf(stderr, "  wrote %luKB file (%.1f%% of original)\n", kb, percent);
-                if (output_image.metadata_size > 0) {
-                    fprintf(stderr, "  copied %dKB of additional PNG metadata\n", (int)(output_image.metadata_size+500)/1000);
-                }
-            } else if (TOO_LARGE_FILE == retval) {
-                unsigned long kb = ((unsigned long)output_image.maximum_file_size + 500UL) / 1000UL;
-                fprintf(stderr, "  file exceeded maximum size of %luKB\n", kb);
-            }
+        if (output_image->metadata_size > 0) {
+            fprintf(log, "  copied %dKB of additional PNG metadata\n", (int)(output_image->metadata_size+500)/1000);
         }
+    } else if (TOO_LARGE_FILE == retval) {
+        unsigned long kb = ((unsigned long)output_image->maximum_file_size + 500UL) / 1000UL;
+        fprintf(log, "  file exceeded maximum size of %luKB\n", kb);
     }
-
-    if (options->using_stdout && (TOO_LARGE_FILE == retval || TOO_LOW_QUALITY == retval)) {
-        // when outputting to stdout it'd be nasty to create 0-byte file
-        // so if quality is too low, output 24-bit original
-        pngloss_error write_retval = write_image(&input_image, NULL, outname, options);
-        if (write_retval) {
-            retval = write_retval;
-        }
-    }
-
-    rwpng_free_image24(&input_image);
-    rwpng_free_image24(&output_image);
-    free(row_filters);
-
-    return retval;
 }
 
 static bool file_exists(const char *outname)
@@ -377,6 +758,20 @@ static bool replace_file(const char *from, const char *to, const bool force) {
 }
 
 static pngloss_error write_image(png24_image *output_image24, unsigned char *row_filters, const char *outname, struct pngloss_options *options)
+{
+    FILE *outfile;
+    char *tempname;
+
+    pngloss_error retval = open_output(outname, options, &outfile, &tempname);
+    if (retval) return retval;
+
+    output_image24->parallel_deflate = options->parallel_deflate;
+    retval = rwpng_write_image24(outfile, output_image24, row_filters, options->threads, options->deflate_trials);
+
+    return close_output(outfile, tempname, outname, options, retval);
+}
+
+static pngloss_error open_output(const char *outname, struct pngloss_options *options, FILE **outfile_p, char **tempname_p)
 {
     FILE *outfile;
     char *tempname = NULL;
@@ -386,26 +781,32 @@ static pngloss_error write_image(png24_image *output_image24, unsigned char *row
         outfile = stdout;
 
         if (options->verbose) {
-            fprintf(stderr, "  writing compressed image to stdout\n");
+            fprintf(options->log, "  writing compressed image to stdout\n");
         }
     } else {
         tempname = temp_filename(outname);
         if (!tempname) return OUT_OF_MEMORY_ERROR;
 
         if ((outfile = fopen(tempname, "wb")) == NULL) {
-            fprintf(stderr, "  error: cannot open '%s' for writing\n", tempname);
+            fprintf(options->log, "  error: cannot open '%s' for writing\n", tempname);
             free(tempname);
             return CANT_WRITE_ERROR;
         }
 
         if (options->verbose) {
-            fprintf(stderr, "  writing compressed image as %s\n", filename_part(outname));
+            fprintf(options->log, "  writing compressed image as %s\n", filename_part(outname));
         }
     }
 
-    pngloss_error retval;
-    retval = rwpng_write_image24(outfile, output_image24, row_filters);
+    *outfile_p = outfile;
+    *tempname_p = tempname;
+    return SUCCESS;
+}
 
+// Finishes the output that open_output started, keeping it only if retval
+// says it was written successfully.
+static pngloss_error close_output(FILE *outfile, char *tempname, const char *outname, struct pngloss_options *options, pngloss_error retval)
+{
     if (!options->using_stdout) {
         fclose(outfile);
 
@@ -424,13 +825,187 @@ static pngloss_error write_image(png24_image *output_image24, unsigned char *row
     free(tempname);
 
     if (retval && retval != TOO_LARGE_FILE) {
-        fprintf(stderr, "  error: failed writing image to %s (%d)\n", options->using_stdout ? "stdout" : outname, retval);
+        fprintf(options->log, "  error: failed writing image to %s (%d)\n", options->using_stdout ? "stdout" : outname, retval);
+    }
+
+    return retval;
+}
+
+static pngloss_error write_original(png24_image *input_image, FILE *log)
+{
+    if (!input_image->file_data) {
+        return READ_ERROR;
+    }
+
+    set_binary_mode(stdout);
+    if (!fwrite(input_image->file_data, input_image->file_size, 1, stdout)) {
+        fprintf(log, "  error: failed writing original image to stdout\n");
+        return CANT_WRITE_ERROR;
+    }
+    return SUCCESS;
+}
+
+// The input is decoded once per pass instead of being held in memory, so
+// streaming needs a file it can read again from the start.
+typedef struct {
+    FILE *infile;
+    png24_image *input_image;
+    rwpng_row_reader *reader;
+    rwpng_row_writer *writer;
+    bool verbose;
+} stream_context;
+
+static pngloss_error stream_read_row(void *context, unsigned char *row)
+{
+    stream_context *stream = context;
+    if (!stream->reader) {
+        pngloss_error retval = rwpng_row_reader_open(&stream->reader, stream->infile, stream->input_image, stream->verbose);
+        if (retval) {
+            return retval;
+        }
+    }
+    return rwpng_read_row(stream->reader, row);
+}
+
+static pngloss_error stream_rewind(void *context)
+{
+    stream_context *stream = context;
+    pngloss_error retval = rwpng_row_reader_close(stream->reader);
+    stream->reader = NULL;
+    if (SUCCESS == retval && fseek(stream->infile, 0, SEEK_SET)) {
+        retval = READ_ERROR;
+    }
+    return retval;
+}
+
+static pngloss_error stream_write_row(void *context, unsigned char *row, unsigned char png_filter)
+{
+    stream_context *stream = context;
+    return rwpng_write_row(stream->writer, row, png_filter);
+}
+
+static pngloss_error copy_original(FILE *infile, FILE *log)
+{
+    char buffer[65536];
+    size_t size;
+
+    set_binary_mode(stdout);
+    if (fseek(infile, 0, SEEK_SET)) {
+        return READ_ERROR;
+    }
+    while ((size = fread(buffer, 1, sizeof(buffer), infile))) {
+        if (!fwrite(buffer, size, 1, stdout)) {
+            fprintf(log, "  error: failed writing original image to stdout\n");
+            return CANT_WRITE_ERROR;
+        }
+    }
+    return ferror(infile) ? READ_ERROR : SUCCESS;
+}
+
+static pngloss_error stream_file(const char *filename, const char *outname, struct pngloss_options *options)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        fprintf(options->log, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+    if (fseek(infile, 0, SEEK_SET)) {
+        fclose(infile);
+        return NOT_STREAMABLE;
+    }
+
+    png24_image input_image = {.width=0};
+    pngloss_error retval = rwpng_scan_image24(infile, &input_image, options->strip, options->verbose);
+    if (NOT_STREAMABLE == retval) {
+        rwpng_free_image24(&input_image);
+        fclose(infile);
+        return retval;
+    }
+    if (retval) {
+        fprintf(options->log, "  error: cannot decode image %s\n", filename_part(filename));
+    }
+
+    if (SUCCESS == retval && options->verbose) {
+        print_input_info(options->log, &input_image);
+    }
+
+    png24_image output_image = {
+        .width = input_image.width,
+        .height = input_image.height,
+        .gamma = input_image.gamma,
+        .output_color = input_image.output_color,
+        .bytes_per_pixel = input_image.bytes_per_pixel,
+        .chunks = input_image.chunks
+    };
+    input_image.chunks = NULL;
+    if (options->skip_if_larger) {
+        output_image.maximum_file_size = input_image.file_size - 1;
+    }
+
+    stream_context context = {
+        .infile = infile,
+        .input_image = &input_image,
+        .reader = NULL,
+        .writer = NULL,
+        .verbose = options->verbose
+    };
+    FILE *outfile = NULL;
+    char *tempname = NULL;
+    if (SUCCESS == retval) {
+        retval = stream_rewind(&context);
+    }
+    if (SUCCESS == retval) {
+        retval = open_output(outname, options, &outfile, &tempname);
+    }
+    if (SUCCESS == retval) {
+        retval = rwpng_row_writer_open(&context.writer, outfile, &output_image);
+    }
+
+    if (SUCCESS == retval) {
+        pngloss_image image = {
+            .rows = NULL,
+            .width = input_image.width,
+            .height = input_image.height,
+            .bytes_per_pixel = input_image.bytes_per_pixel
+        };
+        pngloss_row_stream stream = {
+            .read_row = stream_read_row,
+            .rewind = stream_rewind,
+            .write_row = stream_write_row,
+            .context = &context
+        };
+        retval = optimize_stream(&image, &stream, options->verbose && options->log == stderr, options->strength, options->bleed_divider, options->threads, options->level);
+    }
+
+    rwpng_row_reader_close(context.reader);
+    if (context.writer) {
+        pngloss_error close_retval = rwpng_row_writer_close(context.writer);
+        if (SUCCESS == retval) {
+            retval = close_retval;
+        }
+    }
+    if (outfile) {
+        retval = close_output(outfile, tempname, outname, options, retval);
+        if (options->verbose) {
+            print_output_info(options->log, &input_image, &output_image, retval);
+        }
     }
 
+    if (options->using_stdout && TOO_LARGE_FILE == retval) {
+        pngloss_error write_retval = copy_original(infile, options->log);
+        if (write_retval) {
+            retval = write_retval;
+        }
+    }
+
+    fclose(infile);
+    rwpng_free_image24(&input_image);
+    rwpng_free_image24(&output_image);
+
     return retval;
 }
 
-static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool verbose)
+static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool keep_file_data, bool verbose, FILE *log)
 {
     FILE *infile;
 
@@ -438,47 +1013,39 @@ static pngloss_error read_image(const char *filename, bool using_stdin, png24_im
         set_binary_mode(stdin);
         infile = stdin;
     } else if ((infile = fopen(filename, "rb")) == NULL) {
-        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        fprintf(log, "  error: cannot open %s for reading\n", filename);
         return READ_ERROR;
     }
 
     pngloss_error retval;
-    retval = rwpng_read_image24(infile, input_image_p, strip, verbose);
+    retval = rwpng_read_image24(infile, input_image_p, strip, keep_file_data, verbose);
 
     if (!using_stdin) {
         fclose(infile);
     }
 
     if (retval) {
-        fprintf(stderr, "  error: cannot decode image %s\n", using_stdin ? "from stdin" : filename_part(filename));
+        fprintf(log, "  error: cannot decode image %s\n", using_stdin ? "from stdin" : filename_part(filename));
         return retval;
     }
 
     return SUCCESS;
 }
 
-static pngloss_error prepare_output_image(png24_image *input_image, rwpng_color_transform output_color, png24_image *output_image)
+// The output takes over the decoded pixels, which the optimizer changes in
+// place, keeping only the one row of originals it still needs.
+static void prepare_output_image(png24_image *input_image, rwpng_color_transform output_color, png24_image *output_image)
 {
     output_image->width = input_image->width;
     output_image->height = input_image->height;
     output_image->gamma = input_image->gamma;
     output_image->output_color = output_color;
-
-    /*
-    ** Step 3.7 [GRR]: allocate memory for the entire indexed image
-    */
-
-    output_image->rgba_data = malloc((size_t)output_image->height * (size_t)output_image->width * 4);
-    output_image->row_pointers = malloc((size_t)output_image->height * sizeof(output_image->row_pointers[0]));
-
-    if (!output_image->rgba_data || !output_image->row_pointers) {
-        return OUT_OF_MEMORY_ERROR;
-    }
-
-    for(size_t row = 0; row < output_image->height; row++) {
-        output_image->row_pointers[row] = output_image->rgba_data + row * output_image->width * 4;
-        memcpy(output_image->row_pointers[row], input_image->row_pointers[row], output_image->width * 4);
-    }
-
-    return SUCCESS;
+    output_image->bytes_per_pixel = input_image->bytes_per_pixel;
+
+    output_image->pixel_data = input_image->pixel_data;
+    output_image->mapped_size = input_image->mapped_size;
+    output_image->row_pointers = input_image->row_pointers;
+    input_image->pixel_data = NULL;
+    input_image->mapped_size = 0;
+    input_image->row_pointers = NULL;
 }
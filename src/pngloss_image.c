@@ -16,6 +16,7 @@
 */
 
 #include <png.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -25,12 +26,22 @@
 #include "optimize_state.h"
 #include "pngloss_image.h"
 #include "rwpng.h"
+#include "thread_pool.h"
+
+// the value row_filters holds for each pngloss_filter
+static const unsigned char png_filters[pngloss_filter_count] = {
+    [pngloss_none] = PNG_FILTER_NONE,
+    [pngloss_sub] = PNG_FILTER_SUB,
+    [pngloss_up] = PNG_FILTER_UP,
+    [pngloss_average] = PNG_FILTER_AVG,
+    [pngloss_paeth] = PNG_FILTER_PAETH
+};
 
 void optimizeForAverageFilter(
     unsigned char pixels[], int width, int height, int quantization_strength
 ) {
     const uint_fast8_t bytes_per_pixel = 4;
-    uint32_t stride = width * bytes_per_pixel;
+    size_t stride = (size_t)width * bytes_per_pixel;
     // propagating half the color error is good middle ground
     const int_fast16_t bleed_divider = 2;
 
@@ -38,21 +49,78 @@ void optimizeForAverageFilter(
 }
 
 void optimize_with_stride(
-    unsigned char *pixels, uint32_t width, uint32_t height, uint32_t stride,
+    unsigned char *pixels, uint32_t width, uint32_t height, size_t stride,
     bool verbose, uint_fast8_t quantization_strength, int_fast16_t bleed_divider
 ) {
-    unsigned char **rows = malloc((size_t)height * sizeof(unsigned char *));
-    for (uint32_t i = 0; i < height; i++) {
-        rows[i] = pixels + i*stride;
+    pngloss_scratch scratch = {.rows = NULL};
+    unsigned char **rows = pngloss_scratch_rows(&scratch, pixels, height, stride);
+    if (rows) {
+        optimize_with_scratch(&scratch, rows, width, height, NULL, verbose, quantization_strength, bleed_divider, 1, 1, 9, NULL);
     }
-    optimize_with_rows(rows, width, height, NULL, verbose, quantization_strength, bleed_divider);
-    free(rows);
+    pngloss_scratch_free(&scratch);
 }
 
 pngloss_error optimize_with_rows(
     unsigned char **rows, uint32_t width, uint32_t height,
     unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level
+) {
+    pngloss_scratch scratch = {.rows = NULL};
+    pngloss_error retval = optimize_with_scratch(
+        &scratch, rows, width, height, row_filters, verbose,
+        quantization_strength, bleed_divider, thread_count, band_count, level,
+        NULL
+    );
+    pngloss_scratch_free(&scratch);
+    return retval;
+}
+
+// grows a scratch buffer to at least size bytes, keeping it if it's enough
+static bool scratch_reserve(void **buffer, size_t *capacity, size_t size) {
+    if (*capacity >= size && *buffer) {
+        return true;
+    }
+    free(*buffer);
+    *buffer = malloc(size ? size : 1);
+    *capacity = *buffer ? size : 0;
+    return *buffer != NULL;
+}
+
+unsigned char **pngloss_scratch_rows(
+    pngloss_scratch *scratch, unsigned char *pixels, uint32_t height,
+    size_t stride
+) {
+    if (!scratch_reserve((void **)&scratch->input_rows, &scratch->input_rows_size, (size_t)height * sizeof(unsigned char *))) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < height; i++) {
+        scratch->input_rows[i] = pixels + (size_t)i * stride;
+    }
+    return scratch->input_rows;
+}
+
+unsigned char *pngloss_scratch_row_filters(pngloss_scratch *scratch, uint32_t height) {
+    if (!scratch_reserve((void **)&scratch->row_filters, &scratch->row_filters_size, height)) {
+        return NULL;
+    }
+    return scratch->row_filters;
+}
+
+void pngloss_scratch_free(pngloss_scratch *scratch) {
+    free(scratch->input_rows);
+    free(scratch->rows);
+    free(scratch->pixels);
+    free(scratch->row_filters);
+    *scratch = (pngloss_scratch){.rows = NULL};
+}
+
+pngloss_error optimize_with_scratch(
+    pngloss_scratch *scratch, unsigned char **rows, uint32_t width,
+    uint32_t height, unsigned char *row_filters, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level,
+    const struct timespec *deadline
 ) {
     pngloss_error retval = SUCCESS;
     pngloss_image original_image = {
@@ -66,7 +134,7 @@ pngloss_error optimize_with_rows(
 
     for (uint32_t y = 0; y < height; y++) {
         for (uint32_t x = 0; x < width; x++) {
-            unsigned char *pixel = rows[y] + x*4;
+            unsigned char *pixel = rows[y] + (size_t)x*4;
             if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
                 grayscale = false;
             }
@@ -92,12 +160,12 @@ pngloss_error optimize_with_rows(
             image.bytes_per_pixel = 3;
         }
 
-        image.rows = malloc((size_t)height * sizeof(unsigned char **));
-        unsigned char *pixels = malloc((size_t)height * width * image.bytes_per_pixel);
-
-        if (!image.rows || !pixels) {
+        if (!scratch_reserve((void **)&scratch->rows, &scratch->rows_size, (size_t)height * sizeof(unsigned char *)) ||
+            !scratch_reserve((void **)&scratch->pixels, &scratch->pixels_size, (size_t)height * width * image.bytes_per_pixel)) {
             retval = OUT_OF_MEMORY_ERROR;
         }
+        image.rows = scratch->rows;
+        unsigned char *pixels = scratch->pixels;
 
         // Copying to and from like this is not the most efficient, but it
         // shields the caller from worrying about pixel format and it's
@@ -120,7 +188,7 @@ pngloss_error optimize_with_rows(
                     }
                 }
             }
-            retval = optimize_image(&image, row_filters, verbose, quantization_strength, bleed_divider);
+            retval = optimize_image(&image, row_filters, verbose, quantization_strength, bleed_divider, thread_count, band_count, level, deadline);
         }
         if (SUCCESS == retval) {
             for (uint32_t y = 0; y < height; y++) {
@@ -146,187 +214,667 @@ pngloss_error optimize_with_rows(
                 }
             }
         }
-        free(pixels);
-        free(image.rows);
     } else {
-        retval = optimize_image(&original_image, row_filters, verbose, quantization_strength, bleed_divider);
+        retval = optimize_image(&original_image, row_filters, verbose, quantization_strength, bleed_divider, thread_count, band_count, level, deadline);
     }
 
     return retval;
 }
 
+// rows where no filter worked at full strength, and the extra passes spent
+// finding a strength that did
+typedef struct {
+    uint32_t rows;
+    uint32_t passes;
+} strength_fallback;
+
+typedef struct {
+    pngloss_image *image;
+    optimize_state *state;
+    optimize_state *trials;
+    pthread_mutex_t mutex;
+    uintmax_t costs[pngloss_filter_count];
+    bool finished[pngloss_filter_count];
+    pngloss_filter candidates[pngloss_filter_count];
+    uint_fast8_t candidate_count;
+    unsigned char *last_row_pixels;
+    uint_fast8_t strength;
+    int_fast16_t bleed_divider;
+    bool adaptive;
+} filter_trial_job;
+
+// Each filter gets its own trial state so the five trials of a row can run
+// concurrently. They share nothing but the read-only image and last row.
+static void run_filter_trial(void *context, uint32_t index) {
+    filter_trial_job *job = context;
+    pngloss_filter filter = job->candidates[index];
+    optimize_state *trial = &job->trials[filter];
+
+    // Ties go to the lowest filter, so this trial must beat every earlier
+    // filter and at least match every later one that has already finished.
+    // When running serially all earlier filters are done by now.
+    uintmax_t cost_bound = UINTMAX_MAX;
+    pthread_mutex_lock(&job->mutex);
+    for (pngloss_filter other = 0; other < pngloss_filter_count; other++) {
+        uintmax_t cost = job->costs[other];
+        if (!job->finished[other] || UINTMAX_MAX == cost) {
+            continue;
+        }
+        if (other > filter) {
+            cost++;
+        }
+        if (cost_bound > cost) {
+            cost_bound = cost;
+        }
+    }
+    pthread_mutex_unlock(&job->mutex);
+
+    optimize_state_begin_trial(trial, job->state);
+    uintmax_t cost = optimize_state_row(
+        trial,
+        job->image,
+        job->last_row_pixels,
+        filter,
+        job->strength,
+        job->bleed_divider,
+        job->adaptive,
+        cost_bound
+    );
+
+    pthread_mutex_lock(&job->mutex);
+    job->costs[filter] = cost;
+    job->finished[filter] = true;
+    pthread_mutex_unlock(&job->mutex);
+}
+
+// Orders the filters by how well they suit the original pixels of the row,
+// best first, then moves the previous row's winner up to second place. Only
+// the first few are tried below the highest level. Trying likely winners
+// first also gives the others a tighter cost bound.
+static void rank_filters(
+    pngloss_image *image, uint32_t y, pngloss_filter previous_filter,
+    bool has_previous, pngloss_filter candidates[pngloss_filter_count]
+) {
+    unsigned char *above_row = NULL;
+    if (y > 0) {
+        above_row = image->rows[y - 1];
+    }
+    uint64_t sums[pngloss_filter_count];
+    filter_sums_for_rows(image, above_row, image->rows[y], sums);
+
+    // insertion sort keeps equal sums in filter order
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        uint_fast8_t i = filter;
+        while (i > 0 && sums[candidates[i - 1]] > sums[filter]) {
+            candidates[i] = candidates[i - 1];
+            i--;
+        }
+        candidates[i] = filter;
+    }
+
+    if (has_previous) {
+        uint_fast8_t i = 0;
+        while (candidates[i] != previous_filter) {
+            i++;
+        }
+        for (; i > 1; i--) {
+            candidates[i] = candidates[i - 1];
+        }
+        candidates[i] = previous_filter;
+    }
+}
+
+// Runs the candidate filters on the current row at the given strength and
+// picks the winner in filter order, so ties go the same way no matter which
+// trial finished first. Returns false if no filter succeeded.
+static bool run_filter_trials(
+    filter_trial_job *job, thread_pool *pool, uint_fast8_t strength,
+    pngloss_filter *best_filter
+) {
+    job->strength = strength;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        job->costs[filter] = UINTMAX_MAX;
+        job->finished[filter] = false;
+    }
+    thread_pool_run(pool, run_filter_trial, job->candidate_count, job);
+
+    uintmax_t best_cost = UINTMAX_MAX;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        uintmax_t cost = job->costs[filter];
+        /*
+        fprintf(stderr, "filter %u costs %lu\n", (unsigned int)filter, (unsigned long)cost);
+        */
+        if (best_cost > cost) {
+            best_cost = cost;
+            *best_filter = filter;
+        }
+    }
+    return UINTMAX_MAX != best_cost;
+}
+
+// The two rows of a stream held in memory: the one being optimized and the
+// finished one above it, which it predicts from.
+typedef struct {
+    pngloss_row_stream *stream;
+    unsigned char *rows[2];
+} stream_rows;
+
+// true once deadline has passed, never without one
+static bool deadline_passed(const struct timespec *deadline) {
+    if (!deadline) {
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
 #define spin_count 4
-pngloss_error optimize_image(
-    pngloss_image *image, unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+// Optimizes rows from state->y up to but not including end_y, carrying color
+// error, symbol frequencies and last_row_pixels from one row to the next.
+// With a stream, each row is read just before it is optimized and written
+// just after. Gives up with TIMED_OUT between rows once deadline passes.
+//
+// Rows can't be pipelined without changing the output. Although dithering
+// only reaches a few pixels ahead, the next row also predicts from this
+// row's final pixels, and those aren't known until every filter trial has
+// finished the whole row and the cheapest one has been picked. Each trial
+// also starts from the symbol frequencies left by the previous winner. So
+// the only exact parallelism is across filters, and --bands for the rest.
+static pngloss_error optimize_rows(
+    optimize_state *state, pngloss_image *image, unsigned char *row_filters,
+    uint32_t end_y, unsigned char *last_row_pixels, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint_fast8_t level, strength_fallback *fallback,
+    stream_rows *stream, const struct timespec *deadline
 ) {
-    pngloss_error retval;
+    pngloss_error retval = SUCCESS;
     int spinner[spin_count] = {'-', '/', '|', '\\'};
     uint_fast8_t spin_index = 0;
 
-    optimize_state state = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
-    };
-    retval = optimize_state_init(&state, image);
-
-    optimize_state best = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
-    };
-    if (SUCCESS == retval) {
-        retval = optimize_state_init(&best, image);
+    optimize_state trials[pngloss_filter_count];
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        trials[filter] = (optimize_state){
+            .pixels = NULL,
+            .color_error = NULL,
+            .symbol_frequency = NULL
+        };
+        if (SUCCESS == retval) {
+            retval = optimize_state_clone(&trials[filter], state, image);
+        }
     }
 
-    optimize_state filter_state = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
-    };
+    // more threads than filters would have nothing to do
+    if (thread_count > pngloss_filter_count) {
+        thread_count = pngloss_filter_count;
+    }
+    thread_pool pool;
+    bool pool_started = false;
     if (SUCCESS == retval) {
-        retval = optimize_state_init(&filter_state, image);
+        retval = thread_pool_init(&pool, thread_count);
+        pool_started = (SUCCESS == retval);
     }
 
-    unsigned char *last_row_pixels = NULL;
+    // level 9 tries every filter, every two levels below that try one fewer
+    uint_fast8_t candidate_count = 1 + (level - 1) / 2;
+    if (candidate_count > pngloss_filter_count) {
+        candidate_count = pngloss_filter_count;
+    }
+    filter_trial_job job = {
+        .image = image,
+        .state = state,
+        .trials = trials,
+        .candidate_count = candidate_count,
+        .last_row_pixels = last_row_pixels,
+        .bleed_divider = bleed_divider
+    };
+    bool mutex_started = false;
     if (SUCCESS == retval) {
-        last_row_pixels = calloc((size_t)image->width, image->bytes_per_pixel);
+        if (pthread_mutex_init(&job.mutex, NULL)) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else {
+            mutex_started = true;
+        }
     }
 
     if (SUCCESS == retval) {
         struct timeval tp;
         time_t old_sec = 0;
         suseconds_t old_dsec = 0;
-        while (state.y < image->height) {
-            uint32_t current_y = state.y;
-            uintmax_t best_cost = UINTMAX_MAX;
-            uint_fast8_t best_strength = 0;
-            uint_fast8_t best_filter = 0;
-            bool found_best = false;
-            uint_fast8_t strength = quantization_strength;
+        pngloss_filter previous_filter = pngloss_none;
+        bool has_previous = false;
+        while (SUCCESS == retval && state->y < end_y) {
+            uint32_t current_y = state->y;
+            pngloss_filter best_filter = pngloss_none;
+            if (deadline_passed(deadline)) {
+                retval = TIMED_OUT;
+                break;
+            }
+            if (stream) {
+                image->rows[current_y] = stream->rows[current_y % 2];
+                retval = stream->stream->read_row(stream->stream->context, image->rows[current_y]);
+                if (SUCCESS != retval) {
+                    break;
+                }
+            }
             // PNG spec section 5.9 says,
             // "the first row must always be adaptively filtered"
-            bool adaptive = (!row_filters || !current_y);
-            while (!found_best) {
-            //for (uint_fast8_t strength = 0; strength <= quantization_strength; strength++)
-                for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
-                    if (verbose) {
-                        // print progress display
-                        int err;
-                        err = gettimeofday(&tp, NULL);
-                        if (err) {
-                            spin_index = (spin_index + 1) % spin_count;
-                        } else {
-                            suseconds_t dsec = tp.tv_usec / 100000;
-                            if (old_sec != tp.tv_sec || old_dsec != dsec) {
-                                old_sec = tp.tv_sec;
-                                old_dsec = dsec;
-                                spin_index = (spin_index + 1) % spin_count;
-                            }
-                        }
+            job.adaptive = (!row_filters || !current_y);
+            rank_filters(image, current_y, previous_filter, has_previous, job.candidates);
 
-                        uint_fast8_t progress = filter;
-                        if (strength != quantization_strength) {
-                            progress = pngloss_filter_count;
+            // If no filter succeeds, step down in growing steps until some
+            // strength does, then bisect back up between the two. That finds
+            // a strength that works just below one that fails in a few
+            // passes instead of one pass per strength.
+            uint_fast8_t strength = quantization_strength;
+            uint_fast8_t worked_strength = 0;
+            uint_fast8_t failed_strength = 0;
+            bool have_worked = false;
+            bool have_failed = false;
+            uint_fast16_t step = 1;
+            while (true) {
+                if (verbose) {
+                    // print progress display
+                    int err;
+                    err = gettimeofday(&tp, NULL);
+                    if (err) {
+                        spin_index = (spin_index + 1) % spin_count;
+                    } else {
+                        suseconds_t dsec = tp.tv_usec / 100000;
+                        if (old_sec != tp.tv_sec || old_dsec != dsec) {
+                            old_sec = tp.tv_sec;
+                            old_dsec = dsec;
+                            spin_index = (spin_index + 1) % spin_count;
                         }
-                        float percent = 100.0f * (float)(current_y * (pngloss_filter_count + 1) + progress) / (float)(image->height * (pngloss_filter_count + 1));
+                    }
 
-                        fprintf(stderr, "\x1B[\x01G%c %.1f%% complete", spinner[spin_index], percent);
-                        fflush(stderr);
+                    uint_fast8_t progress = 0;
+                    if (have_failed) {
+                        progress = pngloss_filter_count;
                     }
+                    float percent = 100.0f * ((float)current_y * (pngloss_filter_count + 1) + progress) / ((float)image->height * (pngloss_filter_count + 1));
 
-                    // get to work
-                    optimize_state_copy(&filter_state, &state, image);
-                    uintmax_t cost = optimize_state_row(
-                        &filter_state,
-                        image,
-                        last_row_pixels,
-                        filter,
-                        strength,
-                        bleed_divider,
-                        adaptive
-                    );
-                    /*
-                    fprintf(stderr, "filter %u costs %lu\n", (unsigned int)filter, (unsigned long)cost);
-                    if (cost < (uint32_t)-1) {
-                        fprintf(stderr, "filter %u costs %u\n", (unsigned int)filter, (unsigned int)cost);
+                    fprintf(stderr, "\x1B[\x01G%c %.1f%% complete", spinner[spin_index], percent);
+                    fflush(stderr);
+                }
+
+                // get to work
+                pngloss_filter filter;
+                if (run_filter_trials(&job, &pool, strength, &filter)) {
+                    best_filter = filter;
+                    worked_strength = strength;
+                    have_worked = true;
+                    // the trials hold this pass's rows, keep them if done
+                    if (!have_failed || failed_strength - strength == 1) {
+                        break;
                     }
-                    */
-
-                    if (best_cost > cost) {
-                        best_cost = cost;
-                        best_filter = filter;
-                        best_strength = strength;
-                        found_best = true;
-                        optimize_state_copy(&best, &filter_state, image);
+                } else {
+                    if (!have_failed) {
+                        fallback->rows++;
                     }
-                }
+                    failed_strength = strength;
+                    have_failed = true;
 
-                // If already at zero strength, can't try again, so fail.
-                // This should be impossible but check anyway.
-                if (!found_best && !strength) {
-                    fprintf(stderr, "\naborting because no good row at y == %d\n", (int)current_y);
-                    abort();
+                    // If already at zero strength, can't try again, so fail.
+                    // This should be impossible but check anyway.
+                    if (!strength) {
+                        retval = INTERNAL_ERROR;
+                        break;
+                    }
                 }
+                fallback->passes++;
 
-                // if no filter succeeds, try again at lower quantization strength
-                strength--;
+                if (!have_worked) {
+                    if (strength > step) {
+                        strength -= step;
+                    } else {
+                        strength = 0;
+                    }
+                    step *= 2;
+                } else if (failed_strength - worked_strength > 1) {
+                    strength = worked_strength + (failed_strength - worked_strength) / 2;
+                } else {
+                    // last pass failed, redo the one that worked
+                    strength = worked_strength;
+                }
             }
-            //fprintf(stderr, "row %u best cost %u filter %u strength %u\n", (unsigned int)current_y, (unsigned int)best_cost, (unsigned int)best_filter, (unsigned int)best_strength);
+            if (SUCCESS != retval) {
+                break;
+            }
+            //fprintf(stderr, "row %u best cost %u filter %u\n", (unsigned int)current_y, (unsigned int)best_cost, (unsigned int)best_filter);
+            optimize_state *best = &trials[best_filter];
+            previous_filter = best_filter;
+            has_previous = true;
             memcpy(
                 last_row_pixels,
                 image->rows[current_y],
-                image->width * image->bytes_per_pixel
+                (size_t)image->width * image->bytes_per_pixel
             );
             memcpy(
                 image->rows[current_y],
-                best.pixels,
-                image->width * image->bytes_per_pixel
+                best->pixels,
+                (size_t)image->width * image->bytes_per_pixel
             );
-            optimize_state_copy(&state, &best, image);
+            optimize_state_commit(state, best);
             if (row_filters) {
-                unsigned char best_png_filter;
-                switch (best_filter) {
-                case pngloss_none:
-                    best_png_filter = PNG_FILTER_NONE;
-                    break;
-                case pngloss_sub:
-                    best_png_filter = PNG_FILTER_SUB;
-                    break;
-                case pngloss_up:
-                    best_png_filter = PNG_FILTER_UP;
-                    break;
-                case pngloss_average:
-                    best_png_filter = PNG_FILTER_AVG;
-                    break;
-                case pngloss_paeth:
-                    best_png_filter = PNG_FILTER_PAETH;
-                    break;
-                }
-                row_filters[current_y] = best_png_filter;
+                row_filters[current_y] = png_filters[best_filter];
+            }
+            if (stream) {
+                retval = stream->stream->write_row(stream->stream->context, image->rows[current_y], row_filters[current_y]);
             }
         }
-        // done with progress display, advance to next line for subsequent messages
-        if (verbose) {
-            fputs("\x1B[\x01G  compression complete\n", stderr);
+    }
+
+    if (mutex_started) {
+        pthread_mutex_destroy(&job.mutex);
+    }
+    if (pool_started) {
+        thread_pool_destroy(&pool);
+    }
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        optimize_state_destroy(&trials[filter]);
+    }
+
+    return retval;
+}
+
+typedef struct {
+    pngloss_image *image;
+    optimize_state *state;
+    unsigned char *row_filters;
+    unsigned char *seam_rows;
+    uint32_t band_count;
+    uint_fast8_t level;
+    uint_fast8_t quantization_strength;
+    int_fast16_t bleed_divider;
+    pngloss_error *results;
+    uint32_t *symbol_frequency;
+    strength_fallback *fallbacks;
+    const struct timespec *deadline;
+} band_job;
+
+static uint32_t band_start_y(uint32_t height, uint32_t band_count, uint32_t band) {
+    return (uint32_t)((uint64_t)height * band / band_count);
+}
+
+// Each band starts from the whole-image analysis with no color error and no
+// symbol history of its own, so its result depends only on the band count.
+static void run_band(void *context, uint32_t index) {
+    band_job *job = context;
+    pngloss_image *image = job->image;
+    uint32_t start_y = band_start_y(image->height, job->band_count, index);
+    uint32_t end_y = band_start_y(image->height, job->band_count, index + 1);
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+    pngloss_error retval;
+
+    optimize_state state = {
+        .pixels = NULL,
+        .color_error = NULL,
+        .symbol_frequency = NULL
+    };
+    retval = optimize_state_clone(&state, job->state, image);
+    state.y = start_y;
+
+    pngloss_image band_image = *image;
+    band_image.rows = NULL;
+    if (SUCCESS == retval) {
+        band_image.rows = malloc((size_t)image->height * sizeof(unsigned char *));
+        if (!band_image.rows) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+
+    unsigned char *last_row_pixels = NULL;
+    if (SUCCESS == retval) {
+        last_row_pixels = calloc(rowbytes, 1);
+        if (!last_row_pixels) {
+            retval = OUT_OF_MEMORY_ERROR;
         }
     }
-    if (verbose) {
-        unsigned int used_symbols = 0;
-        for (uint_fast16_t i = 0; i < 256; i++) {
-            uint32_t frequency = best.symbol_frequency[i];
-            if (frequency) {
-                //fprintf(stderr, "  %3u %u\n", (unsigned int)i, (unsigned int)frequency);
-                used_symbols++;
+
+    if (SUCCESS == retval) {
+        memcpy(band_image.rows, image->rows, (size_t)image->height * sizeof(unsigned char *));
+        if (start_y > 0) {
+            // The band above is rewriting the seam row while this one runs,
+            // so predict from the copy of its original pixels taken before
+            // any band started. Its first-order error is zero by definition.
+            unsigned char *seam_row = job->seam_rows + index * rowbytes;
+            band_image.rows[start_y - 1] = seam_row;
+            memcpy(last_row_pixels, seam_row, rowbytes);
+        }
+        retval = optimize_rows(
+            &state, &band_image, job->row_filters, end_y, last_row_pixels,
+            false, job->quantization_strength, job->bleed_divider, 1,
+            job->level, &job->fallbacks[index], NULL, job->deadline
+        );
+    }
+
+    if (SUCCESS == retval) {
+        memcpy(job->symbol_frequency + index * 256, state.symbol_frequency, 256 * sizeof(uint32_t));
+    }
+    job->results[index] = retval;
+
+    optimize_state_destroy(&state);
+    free(band_image.rows);
+    free(last_row_pixels);
+}
+
+static pngloss_error optimize_bands(
+    optimize_state *state, pngloss_image *image, unsigned char *row_filters,
+    uint32_t band_count, uint32_t *symbol_frequency,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint_fast8_t level, strength_fallback *fallback,
+    const struct timespec *deadline
+) {
+    pngloss_error retval = SUCCESS;
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+
+    unsigned char *seam_rows = malloc(band_count * rowbytes);
+    pngloss_error *results = calloc(band_count, sizeof(pngloss_error));
+    uint32_t *band_frequency = calloc((size_t)band_count * 256, sizeof(uint32_t));
+    strength_fallback *band_fallbacks = calloc(band_count, sizeof(strength_fallback));
+    if (!seam_rows || !results || !band_frequency || !band_fallbacks) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    if (thread_count > band_count) {
+        thread_count = band_count;
+    }
+    thread_pool pool;
+    bool pool_started = false;
+    if (SUCCESS == retval) {
+        retval = thread_pool_init(&pool, thread_count);
+        pool_started = (SUCCESS == retval);
+    }
+
+    if (SUCCESS == retval) {
+        for (uint32_t band = 1; band < band_count; band++) {
+            uint32_t start_y = band_start_y(image->height, band_count, band);
+            memcpy(seam_rows + band * rowbytes, image->rows[start_y - 1], rowbytes);
+        }
+
+        band_job job = {
+            .image = image,
+            .state = state,
+            .row_filters = row_filters,
+            .seam_rows = seam_rows,
+            .band_count = band_count,
+            .level = level,
+            .quantization_strength = quantization_strength,
+            .bleed_divider = bleed_divider,
+            .results = results,
+            .symbol_frequency = band_frequency,
+            .fallbacks = band_fallbacks,
+            .deadline = deadline
+        };
+        thread_pool_run(&pool, run_band, band_count, &job);
+
+        for (uint32_t band = 0; band < band_count; band++) {
+            if (SUCCESS != results[band]) {
+                retval = results[band];
+                break;
+            }
+            for (uint_fast16_t i = 0; i < 256; i++) {
+                symbol_frequency[i] += band_frequency[band * 256 + i];
             }
+            fallback->rows += band_fallbacks[band].rows;
+            fallback->passes += band_fallbacks[band].passes;
+        }
+    }
+
+    if (pool_started) {
+        thread_pool_destroy(&pool);
+    }
+    free(seam_rows);
+    free(results);
+    free(band_frequency);
+    free(band_fallbacks);
+
+    return retval;
+}
+
+static void print_results(optimize_state *state, strength_fallback *fallback) {
+    // done with progress display, advance to next line for subsequent messages
+    fputs("\x1B[\x01G  compression complete\n", stderr);
+
+    unsigned int used_symbols = 0;
+    for (uint_fast16_t i = 0; i < 256; i++) {
+        uint32_t frequency = state->symbol_frequency[i];
+        if (frequency) {
+            //fprintf(stderr, "  %3u %u\n", (unsigned int)i, (unsigned int)frequency);
+            used_symbols++;
         }
-        fprintf(stderr, "  used %u unique symbols\n", used_symbols++);
+    }
+    fprintf(stderr, "  used %u unique symbols\n", used_symbols++);
+    fprintf(
+        stderr, "  lowered strength on %u rows in %u extra passes\n",
+        (unsigned int)fallback->rows, (unsigned int)fallback->passes
+    );
+}
+
+pngloss_error optimize_image(
+    pngloss_image *image, unsigned char *row_filters, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level,
+    const struct timespec *deadline
+) {
+    pngloss_error retval;
+
+    optimize_state state = {
+        .pixels = NULL,
+        .color_error = NULL,
+        .symbol_frequency = NULL
+    };
+    image_analysis analysis;
+    retval = image_analysis_init(&analysis, image, thread_count);
+    if (SUCCESS == retval) {
+        retval = optimize_state_init(&state, image, &analysis);
+    }
+    strength_fallback fallback = {.rows = 0, .passes = 0};
+
+    // every band needs at least one row
+    if (band_count > image->height) {
+        band_count = image->height;
+    }
+
+    if (SUCCESS == retval && band_count > 1) {
+        if (verbose) {
+            fprintf(stderr, "  compressing %u bands independently\n", (unsigned int)band_count);
+        }
+        retval = optimize_bands(
+            &state, image, row_filters, band_count, state.symbol_frequency,
+            quantization_strength, bleed_divider, thread_count, level,
+            &fallback, deadline
+        );
+    } else if (SUCCESS == retval) {
+        unsigned char *last_row_pixels = calloc((size_t)image->width, image->bytes_per_pixel);
+        if (last_row_pixels) {
+            retval = optimize_rows(
+                &state, image, row_filters, image->height, last_row_pixels,
+                verbose, quantization_strength, bleed_divider, thread_count,
+                level, &fallback, NULL, deadline
+            );
+        } else {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+        free(last_row_pixels);
+    }
+
+    if (SUCCESS == retval && verbose) {
+        print_results(&state, &fallback);
+    }
+
+    optimize_state_destroy(&state);
+
+    return retval;
+}
+
+// Optimizes an image that is never held in memory as a whole. The first
+// pass over the stream gathers the whole-image analysis, and the second
+// optimizes and writes each row, holding only two of them. Bands need the
+// whole image at once, so a stream is always one band.
+pngloss_error optimize_stream(
+    pngloss_image *image, pngloss_row_stream *stream, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint_fast8_t level
+) {
+    pngloss_error retval = SUCCESS;
+    size_t rowbytes = (size_t)image->width * image->bytes_per_pixel;
+
+    // only two rows are ever in memory, the rest of the row pointers are
+    // left pointing at whichever of them last held that row
+    pngloss_image streamed_image = *image;
+    streamed_image.rows = calloc(image->height, sizeof(unsigned char *));
+    unsigned char *row_filters = malloc(image->height);
+    unsigned char *buffer = malloc(3 * rowbytes);
+    unsigned char *last_row_pixels = calloc(rowbytes, 1);
+    if (!streamed_image.rows || !row_filters || !buffer || !last_row_pixels) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    stream_rows rows = {
+        .stream = stream,
+        .rows = {buffer, buffer + rowbytes}
+    };
+
+    image_analysis analysis;
+    memset(&analysis, 0, sizeof(analysis));
+    for (uint32_t y = 0; SUCCESS == retval && y < image->height; y++) {
+        unsigned char *row = rows.rows[y % 2];
+        retval = stream->read_row(stream->context, row);
+        if (SUCCESS == retval) {
+            unsigned char *above_row = y ? rows.rows[(y - 1) % 2] : NULL;
+            image_analysis_add_row(&analysis, &streamed_image, above_row, row, buffer + 2 * rowbytes);
+        }
+    }
+    if (SUCCESS == retval) {
+        retval = stream->rewind(stream->context);
+    }
+
+    optimize_state state = {
+        .pixels = NULL,
+        .color_error = NULL,
+        .symbol_frequency = NULL
+    };
+    if (SUCCESS == retval) {
+        retval = optimize_state_init(&state, &streamed_image, &analysis);
+    }
+    strength_fallback fallback = {.rows = 0, .passes = 0};
+    if (SUCCESS == retval) {
+        retval = optimize_rows(
+            &state, &streamed_image, row_filters, image->height,
+            last_row_pixels, verbose, quantization_strength, bleed_divider,
+            thread_count, level, &fallback, &rows, NULL
+        );
+    }
+
+    if (SUCCESS == retval && verbose) {
+        print_results(&state, &fallback);
     }
 
     optimize_state_destroy(&state);
-    optimize_state_destroy(&best);
-    optimize_state_destroy(&filter_state);
+    free(streamed_image.rows);
+    free(row_filters);
+    free(buffer);
     free(last_row_pixels);
 
     return retval;
@@ -1,6 +1,8 @@
 #ifndef PNGLOSS_IMAGE_H
 #define PNGLOSS_IMAGE_H
 
+#include <time.h>
+
 #include "rwpng.h"
 
 // data structures
@@ -10,22 +12,64 @@ typedef struct {
     uint_fast8_t bytes_per_pixel;
 } pngloss_image;
 
+// Feeds an image through the optimizer a row at a time. read_row gives the
+// next original row, rewind starts reading from the first row again, and
+// write_row takes each finished row in order with the PNG filter chosen for
+// it.
+typedef struct {
+    pngloss_error (*read_row)(void *context, unsigned char *row);
+    pngloss_error (*rewind)(void *context);
+    pngloss_error (*write_row)(void *context, unsigned char *row, unsigned char png_filter);
+    void *context;
+} pngloss_row_stream;
+
+// Buffers for optimize_with_scratch that can be kept from one image to the
+// next. Start with all fields zero and release with pngloss_scratch_free.
+typedef struct {
+    unsigned char **input_rows;
+    unsigned char **rows;
+    unsigned char *pixels;
+    unsigned char *row_filters;
+    size_t input_rows_size, rows_size, pixels_size, row_filters_size;
+} pngloss_scratch;
+
 // function prototypes
 void optimizeForAverageFilter(
     unsigned char pixels[], int width, int height, int quantization
 );
 void optimize_with_stride(
-    unsigned char *pixels, uint32_t width, uint32_t height, uint32_t stride,
+    unsigned char *pixels, uint32_t width, uint32_t height, size_t stride,
     bool verbose, uint_fast8_t quantization_strength, int_fast16_t bleed_divider
 );
 pngloss_error optimize_with_rows(
     unsigned char **rows, uint32_t width, uint32_t height,
     unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level
+);
+unsigned char **pngloss_scratch_rows(
+    pngloss_scratch *scratch, unsigned char *pixels, uint32_t height,
+    size_t stride
+);
+unsigned char *pngloss_scratch_row_filters(pngloss_scratch *scratch, uint32_t height);
+void pngloss_scratch_free(pngloss_scratch *scratch);
+pngloss_error optimize_with_scratch(
+    pngloss_scratch *scratch, unsigned char **rows, uint32_t width,
+    uint32_t height, unsigned char *row_filters, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level,
+    const struct timespec *deadline
 );
 pngloss_error optimize_image(
     pngloss_image *image, unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint32_t band_count, uint_fast8_t level,
+    const struct timespec *deadline
+);
+pngloss_error optimize_stream(
+    pngloss_image *image, pngloss_row_stream *stream, bool verbose,
+    uint_fast8_t quantization_strength, int_fast16_t bleed_divider,
+    uint_fast8_t thread_count, uint_fast8_t level
 );
 
 #endif // PNGLOSS_IMAGE_H
@@ -17,7 +17,7 @@
 extern char *optarg;
 extern int optind, opterr;
 
-enum {arg_ext, arg_no_force, arg_skip_larger, arg_strip};
+enum {arg_ext, arg_no_force, arg_skip_larger, arg_strip, arg_bands, arg_stream, arg_memory_limit, arg_deflate_trials, arg_serve, arg_timeout, arg_parallel_deflate};
 
 static const struct option long_options[] = {
     {"verbose", no_argument, NULL, 'v'},
@@ -32,6 +32,15 @@ static const struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
     {"strength", required_argument, NULL, 's'},
     {"bleed", required_argument, NULL, 'b'},
+    {"threads", required_argument, NULL, 't'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"bands", required_argument, NULL, arg_bands},
+    {"stream", no_argument, NULL, arg_stream},
+    {"memory-limit", required_argument, NULL, arg_memory_limit},
+    {"trials", required_argument, NULL, arg_deflate_trials},
+    {"parallel-deflate", no_argument, NULL, arg_parallel_deflate},
+    {"serve", required_argument, NULL, arg_serve},
+    {"timeout", required_argument, NULL, arg_timeout},
     {NULL, 0, NULL, 0},
 };
 
@@ -43,8 +52,20 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
         unsigned long strength;
         char *bleed_end;
         unsigned long bleed_divider;
-
-        opt = getopt_long(argc, argv, "vqfo:Vhs:b:", long_options, NULL);
+        char *threads_end;
+        unsigned long threads;
+        char *jobs_end;
+        unsigned long jobs;
+        char *bands_end;
+        unsigned long bands;
+        char *memory_limit_end;
+        unsigned long memory_limit;
+        char *deflate_trials_end;
+        unsigned long deflate_trials;
+        char *timeout_end;
+        unsigned long timeout;
+
+        opt = getopt_long(argc, argv, "vqfo:Vhs:b:t:j:123456789", long_options, NULL);
         switch (opt) {
             case 'v':
                 options->verbose = true;
@@ -76,6 +97,28 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
                 options->strip = true;
                 break;
 
+            case arg_stream:
+                options->stream = true;
+                break;
+
+            case arg_parallel_deflate:
+                options->parallel_deflate = true;
+                break;
+
+            case arg_serve:
+                options->serve_path = optarg;
+                break;
+
+            case arg_timeout:
+                timeout = strtoul(optarg, &timeout_end, 10);
+                if (timeout_end != optarg && '\0' == timeout_end[0]) {
+                    options->timeout = timeout;
+                } else {
+                    fputs("--timeout requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
             case 'h':
                 options->print_help = true;
                 break;
@@ -84,13 +127,11 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
                 options->print_version = true;
                 break;
 
-            /*
             case '1': case '2': case '3':
             case '4': case '5': case '6':
             case '7': case '8': case '9':
                 options->level = opt - '0';
                 break;
-            */
 
             case 's':
                 strength = strtoul(optarg, &strength_end, 10);
@@ -112,6 +153,56 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
                 }
                 break;
 
+            case 't':
+                threads = strtoul(optarg, &threads_end, 10);
+                if (threads_end != optarg && '\0' == threads_end[0]) {
+                    options->threads = threads;
+                } else {
+                    fputs("-t, --threads requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case 'j':
+                jobs = strtoul(optarg, &jobs_end, 10);
+                if (jobs_end != optarg && '\0' == jobs_end[0]) {
+                    options->jobs = jobs;
+                } else {
+                    fputs("-j, --jobs requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_bands:
+                bands = strtoul(optarg, &bands_end, 10);
+                if (bands_end != optarg && '\0' == bands_end[0]) {
+                    options->bands = bands;
+                } else {
+                    fputs("--bands requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_memory_limit:
+                memory_limit = strtoul(optarg, &memory_limit_end, 10);
+                if (memory_limit_end != optarg && '\0' == memory_limit_end[0]) {
+                    options->memory_limit = memory_limit;
+                } else {
+                    fputs("--memory-limit requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_deflate_trials:
+                deflate_trials = strtoul(optarg, &deflate_trials_end, 10);
+                if (deflate_trials_end != optarg && '\0' == deflate_trials_end[0]) {
+                    options->deflate_trials = deflate_trials;
+                } else {
+                    fputs("--trials requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
             case -1: break;
 
             default:
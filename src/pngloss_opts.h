@@ -4,12 +4,21 @@
 struct pngloss_options {
     const char *extension;
     const char *output_file_path;
+    const char *serve_path;
     char *const *files;
     unsigned long strength;
     unsigned long bleed_divider;
+    unsigned long threads;
+    unsigned long jobs;
+    unsigned long bands;
+    unsigned long memory_limit;
+    unsigned long deflate_trials;
+    unsigned long timeout;
+    unsigned int level;
     unsigned int num_files;
+    FILE *log;
     bool using_stdin, using_stdout, force,
-        skip_if_larger, strip,
+        skip_if_larger, strip, stream, parallel_deflate,
         print_help, print_version, missing_arguments,
         verbose;
 };
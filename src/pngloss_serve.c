@@ -0,0 +1,379 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pngloss_serve.h"
+
+#if defined(_WIN32) || defined(WIN32) || defined(__WIN32__)
+
+pngloss_error pngloss_serve(struct pngloss_options *options)
+{
+#pragma unused(options)
+    fputs("--serve needs Unix domain sockets, which this build doesn't have\n", stderr);
+    return INVALID_ARGUMENT;
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Requests and responses are framed with a short header of big-endian
+ * fields. A request is
+ *   4 bytes  "PNGL"
+ *   4 bytes  size of the PNG file that follows
+ *   1 byte   strength, 0-255
+ *   1 byte   1 to strip metadata, otherwise 0
+ *   2 bytes  bleed divider, 1-32767
+ * followed by the PNG file, and its response is
+ *   4 bytes  pngloss_error status, 0 for success
+ *   4 bytes  size of the compressed PNG file that follows, 0 on failure
+ * A connection can carry any number of requests, one after another. */
+#define SERVE_REQUEST_HEADER_SIZE 12
+#define SERVE_RESPONSE_HEADER_SIZE 8
+#define SERVE_MAX_PNG_SIZE ((uint32_t)256 << 20)
+// 8192x8192, a quarter gigabyte of RGBA, however small the file
+#define SERVE_MAX_PIXELS ((uint64_t)1 << 26)
+
+// connections accepted but not yet picked up by a worker
+#define SERVE_QUEUE_SIZE 64
+
+typedef struct {
+    int fd;
+    time_t accepted;
+} serve_connection;
+
+typedef struct {
+    struct pngloss_options *options;
+    serve_connection queue[SERVE_QUEUE_SIZE];
+    unsigned int first, count;
+    bool stopping;
+    pthread_t *workers;
+    unsigned long worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+} serve_state;
+
+static uint32_t get_be32(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static void put_be32(unsigned char *bytes, uint32_t value)
+{
+    bytes[0] = (value >> 24) & 0xFF;
+    bytes[1] = (value >> 16) & 0xFF;
+    bytes[2] = (value >> 8) & 0xFF;
+    bytes[3] = value & 0xFF;
+}
+
+static struct timespec deadline_after(unsigned long seconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+    return deadline;
+}
+
+// false once the deadline has passed
+static bool remaining_ms(struct timespec deadline, int *ms)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t left = (int64_t)(deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+    *ms = left > INT32_MAX ? INT32_MAX : (int)left;
+    return left > 0;
+}
+
+// Waits until fd is ready for events or the deadline passes. A client can
+// trickle bytes, so the deadline covers the whole transfer rather than each
+// read or write.
+static bool wait_ready(int fd, short events, struct timespec deadline)
+{
+    while (true) {
+        int ms;
+        if (!remaining_ms(deadline, &ms)) {
+            return false;
+        }
+        struct pollfd pollfd = {.fd = fd, .events = events};
+        int ready = poll(&pollfd, 1, ms);
+        if (ready < 0 && EINTR == errno) {
+            continue;
+        }
+        return ready > 0;
+    }
+}
+
+// false on end of file, error or timeout
+static bool read_fully(int fd, unsigned char *data, size_t size, struct timespec deadline)
+{
+    while (size) {
+        if (!wait_ready(fd, POLLIN, deadline)) {
+            return false;
+        }
+        ssize_t got = recv(fd, data, size, MSG_DONTWAIT);
+        if (got < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const unsigned char *data, size_t size, struct timespec deadline)
+{
+    while (size) {
+        if (!wait_ready(fd, POLLOUT, deadline)) {
+            return false;
+        }
+        ssize_t put = send(fd, data, size, MSG_DONTWAIT);
+        if (put < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        data += put;
+        size -= put;
+    }
+    return true;
+}
+
+static bool send_response(int fd, pngloss_error status, const unsigned char *png, size_t size, unsigned long timeout)
+{
+    unsigned char header[SERVE_RESPONSE_HEADER_SIZE];
+    put_be32(header, status);
+    put_be32(header + 4, size);
+    struct timespec deadline = deadline_after(timeout);
+    return write_fully(fd, header, sizeof(header), deadline) && write_fully(fd, png, size, deadline);
+}
+
+// Answers requests on a connection until the client closes it, takes longer
+// than the timeout to send a request or receive a response, or sends
+// something that isn't a request. The wait for each request counts toward
+// its time, so idle connections are dropped too.
+static void serve_requests(serve_state *state, pngloss_context *context, int fd)
+{
+    unsigned long timeout = state->options->timeout;
+    unsigned char header[SERVE_REQUEST_HEADER_SIZE];
+    struct timespec deadline = deadline_after(timeout);
+    while (read_fully(fd, header, sizeof(header), deadline)) {
+        uint32_t png_size = get_be32(header + 4);
+        unsigned int strength = header[8];
+        unsigned int strip = header[9];
+        unsigned int bleed_divider = (unsigned int)header[10] << 8 | header[11];
+        if (memcmp(header, "PNGL", 4) || !png_size || png_size > SERVE_MAX_PNG_SIZE ||
+            SUCCESS != pngloss_set_strength(context, strength) ||
+            SUCCESS != pngloss_set_bleed_divider(context, bleed_divider)) {
+            send_response(fd, INVALID_ARGUMENT, NULL, 0, timeout);
+            return;
+        }
+        pngloss_set_strip(context, strip);
+
+        unsigned char *png = malloc(png_size);
+        if (!png) {
+            send_response(fd, OUT_OF_MEMORY_ERROR, NULL, 0, timeout);
+            return;
+        }
+        if (!read_fully(fd, png, png_size, deadline)) {
+            free(png);
+            return;
+        }
+
+        unsigned char *out = NULL;
+        size_t out_size = 0;
+        pngloss_error retval = pngloss_compress_png(context, png, png_size, &out, &out_size);
+        bool sent = send_response(fd, retval, out, out_size, timeout);
+        if (state->options->verbose) {
+            fprintf(stderr, "  compressed %luKB to %luKB (status %d)\n", (unsigned long)(png_size+500UL)/1000UL, (unsigned long)(out_size+500UL)/1000UL, (int)retval);
+        }
+        free(png);
+        free(out);
+        if (!sent) {
+            return;
+        }
+        deadline = deadline_after(timeout);
+    }
+}
+
+static void *serve_worker(void *arg)
+{
+    serve_state *state = arg;
+    struct pngloss_options *options = state->options;
+    pngloss_context *context = pngloss_context_create();
+    if (context) {
+        pngloss_set_threads(context, options->threads);
+        pngloss_set_bands(context, options->bands);
+        pngloss_set_level(context, options->level);
+        pngloss_set_max_pixels(context, SERVE_MAX_PIXELS);
+        pngloss_set_time_limit(context, options->timeout);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&state->mutex);
+        while (!state->count && !state->stopping) {
+            pthread_cond_wait(&state->ready, &state->mutex);
+        }
+        if (state->stopping) {
+            pthread_mutex_unlock(&state->mutex);
+            break;
+        }
+        serve_connection connection = state->queue[state->first];
+        state->first = (state->first + 1) % SERVE_QUEUE_SIZE;
+        state->count--;
+        pthread_mutex_unlock(&state->mutex);
+
+        if (!context) {
+            send_response(connection.fd, OUT_OF_MEMORY_ERROR, NULL, 0, options->timeout);
+        } else if (difftime(time(NULL), connection.accepted) > options->timeout) {
+            send_response(connection.fd, TIMED_OUT, NULL, 0, options->timeout);
+        } else {
+            serve_requests(state, context, connection.fd);
+        }
+        close(connection.fd);
+    }
+    pngloss_context_destroy(context);
+    return NULL;
+}
+
+// Stops the workers once they finish their current connection, and closes
+// the connections still waiting for one.
+static void stop_workers(serve_state *state)
+{
+    pthread_mutex_lock(&state->mutex);
+    state->stopping = true;
+    pthread_cond_broadcast(&state->ready);
+    pthread_mutex_unlock(&state->mutex);
+
+    for (unsigned long i = 0; i < state->worker_count; i++) {
+        pthread_join(state->workers[i], NULL);
+    }
+    free(state->workers);
+    state->workers = NULL;
+    state->worker_count = 0;
+
+    for (; state->count; state->count--) {
+        close(state->queue[state->first].fd);
+        state->first = (state->first + 1) % SERVE_QUEUE_SIZE;
+    }
+    pthread_cond_destroy(&state->ready);
+    pthread_mutex_destroy(&state->mutex);
+}
+
+// Listens on a Unix domain socket and compresses what comes in, forever.
+// Connections are queued for a fixed set of workers, and turned away as
+// busy when the queue is full.
+pngloss_error pngloss_serve(struct pngloss_options *options)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(options->serve_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "  error: socket path '%s' is too long\n", options->serve_path);
+        return INVALID_ARGUMENT;
+    }
+    strcpy(address.sun_path, options->serve_path);
+
+    // a socket left behind by an earlier server would block bind, but
+    // anything else at the path is left alone
+    struct stat existing;
+    if (!lstat(options->serve_path, &existing)) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "  error: '%s' exists and isn't a socket\n", options->serve_path);
+            return NOT_OVERWRITING_ERROR;
+        }
+        unlink(options->serve_path);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "  error: cannot create socket (%s)\n", strerror(errno));
+        return CANT_WRITE_ERROR;
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, SERVE_QUEUE_SIZE)) {
+        fprintf(stderr, "  error: cannot listen on '%s' (%s)\n", options->serve_path, strerror(errno));
+        close(listener);
+        return CANT_WRITE_ERROR;
+    }
+
+    // clients that hang up early must not take the server down with them
+    signal(SIGPIPE, SIG_IGN);
+
+    serve_state state = {.options = options};
+    if (pthread_mutex_init(&state.mutex, NULL)) {
+        fputs("  error: cannot start worker threads\n", stderr);
+        close(listener);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_cond_init(&state.ready, NULL)) {
+        pthread_mutex_destroy(&state.mutex);
+        fputs("  error: cannot start worker threads\n", stderr);
+        close(listener);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    // carry on with however many workers start, as long as one does
+    state.workers = calloc(options->jobs, sizeof(pthread_t));
+    for (unsigned long i = 0; state.workers && i < options->jobs; i++) {
+        if (pthread_create(&state.workers[i], NULL, serve_worker, &state)) {
+            break;
+        }
+        state.worker_count++;
+    }
+    if (!state.worker_count) {
+        stop_workers(&state);
+        fputs("  error: cannot start worker threads\n", stderr);
+        close(listener);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (options->verbose || state.worker_count < options->jobs) {
+        fprintf(stderr, "serving on %s with %lu worker%s\n", options->serve_path, state.worker_count, state.worker_count == 1 ? "" : "s");
+    }
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (EINTR == errno || ECONNABORTED == errno) {
+                continue;
+            }
+            fprintf(stderr, "  error: cannot accept connections (%s)\n", strerror(errno));
+            close(listener);
+            stop_workers(&state);
+            return READ_ERROR;
+        }
+        pthread_mutex_lock(&state.mutex);
+        bool queued = state.count < SERVE_QUEUE_SIZE;
+        if (queued) {
+            state.queue[(state.first + state.count) % SERVE_QUEUE_SIZE] = (serve_connection){
+                .fd = fd,
+                .accepted = time(NULL)
+            };
+            state.count++;
+            pthread_cond_signal(&state.ready);
+        }
+        pthread_mutex_unlock(&state.mutex);
+
+        if (!queued) {
+            send_response(fd, SERVER_BUSY, NULL, 0, options->timeout);
+            close(fd);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef PNGLOSS_SERVE_H
+#define PNGLOSS_SERVE_H
+
+#include "libpngloss.h"
+#include "pngloss_opts.h"
+
+// function prototypes
+pngloss_error pngloss_serve(struct pngloss_options *options);
+
+#endif // PNGLOSS_SERVE_H
@@ -12,12 +12,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#if !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define RWPNG_SPILL 1
+#endif
 #include <png.h>  // if this include fails, you need to install libpng (e.g. libpng-devel package)
+#include <zlib.h>
 
 #if USE_LCMS
 #include "lcms2.h"
 #endif
 #include "rwpng.h"
+#include "optimize_state.h"
+#include "thread_pool.h"
 
 #ifndef Z_BEST_COMPRESSION
 #define Z_BEST_COMPRESSION 9
@@ -65,8 +74,12 @@ void rwpng_version_info(FILE *fp)
 
 
 struct rwpng_read_data {
-    FILE *const fp;
+    FILE *fp; // or NULL to read from buffer
+    const unsigned char *buffer;
+    size_t buffer_size;
     png_size_t bytes_read;
+    unsigned char **file_data; // NULL unless the file's bytes are kept
+    png_size_t file_capacity;
 };
 
 #if !USE_COCOA
@@ -74,18 +87,46 @@ static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t lengt
 {
     struct rwpng_read_data *read_data = (struct rwpng_read_data *)png_get_io_ptr(png_ptr);
 
-    png_size_t read = fread(data, 1, length, read_data->fp);
+    png_size_t read;
+    if (read_data->fp) {
+        read = fread(data, 1, length, read_data->fp);
+    } else {
+        read = read_data->buffer_size - read_data->bytes_read;
+        if (read > length) {
+            read = length;
+        }
+        memcpy(data, read_data->buffer + read_data->bytes_read, read);
+    }
     if (!read) {
         png_error(png_ptr, "Read error");
     }
+
+    if (read_data->file_data) {
+        if (read_data->bytes_read + read > read_data->file_capacity) {
+            png_size_t capacity = read_data->file_capacity ? read_data->file_capacity * 2 : 65536;
+            while (capacity < read_data->bytes_read + read) {
+                capacity *= 2;
+            }
+            unsigned char *grown = realloc(*read_data->file_data, capacity);
+            if (!grown) {
+                png_error(png_ptr, "Out of memory keeping file data");
+            }
+            *read_data->file_data = grown;
+            read_data->file_capacity = capacity;
+        }
+        memcpy(*read_data->file_data + read_data->bytes_read, data, read);
+    }
     read_data->bytes_read += read;
 }
 #endif
 
 struct rwpng_write_state {
-    FILE *outfile;
+    FILE *outfile; // or NULL to write to buffer
+    unsigned char **buffer;
+    size_t buffer_capacity;
     png_size_t maximum_file_size;
     png_size_t bytes_written;
+    unsigned char *held; // output held back until it's known to fit
     pngloss_error retval;
 };
 
@@ -97,7 +138,32 @@ static void user_write_data(png_structp png_ptr, png_bytep data, png_size_t leng
         return;
     }
 
-    if (!fwrite(data, length, 1, write_state->outfile)) {
+    if (write_state->held) {
+        if (write_state->bytes_written + length > write_state->maximum_file_size) {
+            write_state->retval = TOO_LARGE_FILE;
+            return;
+        }
+        memcpy(write_state->held + write_state->bytes_written, data, length);
+    } else if (!write_state->outfile) {
+        if (write_state->maximum_file_size && write_state->bytes_written + length > write_state->maximum_file_size) {
+            write_state->retval = TOO_LARGE_FILE;
+            return;
+        }
+        if (write_state->bytes_written + length > write_state->buffer_capacity) {
+            size_t capacity = write_state->buffer_capacity ? write_state->buffer_capacity * 2 : 65536;
+            while (capacity < write_state->bytes_written + length) {
+                capacity *= 2;
+            }
+            unsigned char *grown = realloc(*write_state->buffer, capacity);
+            if (!grown) {
+                write_state->retval = OUT_OF_MEMORY_ERROR;
+                return;
+            }
+            *write_state->buffer = grown;
+            write_state->buffer_capacity = capacity;
+        }
+        memcpy(*write_state->buffer + write_state->bytes_written, data, length);
+    } else if (!fwrite(data, length, 1, write_state->outfile)) {
         write_state->retval = CANT_WRITE_ERROR;
     }
 
@@ -111,18 +177,92 @@ static void user_flush_data(png_structp png_ptr)
 }
 
 
-static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_ptr, unsigned char *base, size_t height, png_size_t rowbytes)
+static void rwpng_free_pixels(png24_image *image)
+{
+#if RWPNG_SPILL
+    if (image->mapped_size) {
+        munmap(image->pixel_data, image->mapped_size);
+        image->mapped_size = 0;
+        image->pixel_data = NULL;
+        return;
+    }
+#endif
+    free(image->pixel_data);
+    image->pixel_data = NULL;
+    image->pixel_data_size = 0;
+}
+
+/* Pixels larger than image->spill_size, or too large for malloc, live in a
+ * scratch file mapped into memory, so the system can page them out to disk
+ * instead of failing. The file is unlinked as soon as it is created. A
+ * buffer the image already holds from an earlier file is reused if it is
+ * large enough. */
+static unsigned char *rwpng_alloc_pixels(png24_image *image, size_t size)
+{
+    if (image->pixel_data && !image->mapped_size && size <= image->pixel_data_size) {
+        return image->pixel_data;
+    }
+    rwpng_free_pixels(image);
+    if (!image->spill_size || size <= image->spill_size) {
+        unsigned char *pixels = malloc(size);
+        if (pixels) {
+            image->pixel_data_size = size;
+            return pixels;
+        }
+    }
+#if RWPNG_SPILL
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) {
+        dir = P_tmpdir;
+    }
+    size_t dir_length = strlen(dir);
+    char *path = malloc(dir_length + sizeof("/pngloss-XXXXXX"));
+    if (!path) {
+        return NULL;
+    }
+    memcpy(path, dir, dir_length);
+    strcpy(path + dir_length, "/pngloss-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    unlink(path);
+    free(path);
+
+    void *pixels = MAP_FAILED;
+    if (size <= (uintmax_t)INTMAX_MAX && 0 == ftruncate(fd, (off_t)size)) {
+        pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == pixels) {
+        return NULL;
+    }
+    image->mapped_size = size;
+    return pixels;
+#else
+    return NULL;
+#endif
+}
+
+/* points the image's row_pointers into pixel_data, reusing them if the image
+ * already holds enough from an earlier file */
+static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_ptr, png24_image *image, png_size_t rowbytes)
 {
     if (!rowbytes) {
         rowbytes = png_get_rowbytes(png_ptr, info_ptr);
     }
 
-    png_bytepp row_pointers = malloc(height * sizeof(row_pointers[0]));
-    if (!row_pointers) return NULL;
-    for(size_t row = 0; row < height; row++) {
-        row_pointers[row] = base + row * rowbytes;
+    if (!image->row_pointers || image->row_pointers_height < image->height) {
+        free(image->row_pointers);
+        image->row_pointers = malloc(image->height * sizeof(image->row_pointers[0]));
+        image->row_pointers_height = image->row_pointers ? image->height : 0;
+        if (!image->row_pointers) return NULL;
     }
-    return row_pointers;
+    for(size_t row = 0; row < image->height; row++) {
+        image->row_pointers[row] = image->pixel_data + row * rowbytes;
+    }
+    return (png_bytepp)image->row_pointers;
 }
 
 #if !USE_COCOA
@@ -176,33 +316,11 @@ static void rwpng_warning_silent_handler(png_structp png_ptr, png_const_charp ms
 #pragma unused(png_ptr, msg)
 }
 
-static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr, bool strip, bool verbose)
+/* Reads everything up to the image data and sets up the transformations
+ * shared by the whole-image and row readers. Returns the color type before
+ * those transformations. The caller must have called setjmp(). */
+static int rwpng_read_header(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr, bool strip, struct rwpng_read_data *read_data)
 {
-    png_structp  png_ptr = NULL;
-    png_infop    info_ptr = NULL;
-    png_size_t   rowbytes;
-    int          color_type, bit_depth;
-
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
-      rwpng_error_handler, verbose ? rwpng_warning_stderr_handler : rwpng_warning_silent_handler);
-    if (!png_ptr) {
-        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
-    }
-
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
-    }
-
-    /* setjmp() must be called in every function that calls a non-trivial
-     * libpng function */
-
-    if (setjmp(mainprog_ptr->jmpbuf)) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
-    }
-
 #if defined(PNG_SKIP_sRGB_CHECK_PROFILE) && defined(PNG_SET_OPTION_SUPPORTED)
     png_set_option(png_ptr, PNG_SKIP_sRGB_CHECK_PROFILE, PNG_OPTION_ON);
 #endif
@@ -217,8 +335,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         png_set_read_user_chunk_fn(png_ptr, &mainprog_ptr->chunks, read_chunk_callback);
     }
 
-    struct rwpng_read_data read_data = {infile, 0};
-    png_set_read_fn(png_ptr, &read_data, user_read_data);
+    png_set_read_fn(png_ptr, read_data, user_read_data);
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
 
@@ -226,35 +343,25 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
      * etc., but want bit_depth and color_type for later [don't care about
      * compression_type and filter_type => NULLs] */
 
+    int color_type, bit_depth;
     png_get_IHDR(png_ptr, info_ptr, &mainprog_ptr->width, &mainprog_ptr->height,
                  &bit_depth, &color_type, NULL, NULL, NULL);
 
     /* expand palette images to RGB, low-bit-depth grayscale images to 8 bits,
-     * transparency chunks to full alpha channel; strip 16-bit-per-sample
-     * images to 8 bits per sample; and convert grayscale to RGB[A] */
+     * transparency chunks to full alpha channel; and strip 16-bit-per-sample
+     * images to 8 bits per sample. Gray stays gray, so the image is read
+     * in the narrowest format that holds it without loss. */
 
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
 
     if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
-#ifdef PNG_READ_FILLER_SUPPORTED
         png_set_expand(png_ptr);
-        png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
-#else
-        fprintf(stderr, "pngloss readpng:  image is neither RGBA nor GA\n");
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        mainprog_ptr->retval = WRONG_INPUT_COLOR_TYPE;
-        return mainprog_ptr->retval;
-#endif
     }
 
     if (bit_depth == 16) {
         png_set_strip_16(png_ptr);
     }
 
-    if (!(color_type & PNG_COLOR_MASK_COLOR)) {
-        png_set_gray_to_rgb(png_ptr);
-    }
-
     /* get source gamma for gamma correction, or use sRGB default */
     double gamma = 0.45455;
     if (png_get_valid(png_ptr, info_ptr, PNG_INFO_sRGB)) {
@@ -266,7 +373,9 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
             mainprog_ptr->input_color = RWPNG_GAMA_ONLY;
             mainprog_ptr->output_color = RWPNG_GAMA_ONLY;
         } else {
-            fprintf(stderr, "pngloss readpng:  ignored out-of-range gamma %f\n", gamma);
+            if (!mainprog_ptr->quiet) {
+                fprintf(stderr, "pngloss readpng:  ignored out-of-range gamma %f\n", gamma);
+            }
             mainprog_ptr->input_color = RWPNG_NONE;
             mainprog_ptr->output_color = RWPNG_NONE;
             gamma = 0.45455;
@@ -274,6 +383,47 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
     }
     mainprog_ptr->gamma = gamma;
 
+    return color_type;
+}
+
+static pngloss_error rwpng_read_image24_libpng(struct rwpng_read_data *read_data, png24_image *mainprog_ptr, bool strip, bool verbose)
+{
+    png_structp  png_ptr = NULL;
+    png_infop    info_ptr = NULL;
+    png_size_t   rowbytes;
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
+      rwpng_error_handler, verbose ? rwpng_warning_stderr_handler : rwpng_warning_silent_handler);
+    if (!png_ptr) {
+        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+    }
+
+    /* setjmp() must be called in every function that calls a non-trivial
+     * libpng function */
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
+    }
+
+#if USE_LCMS
+    int color_type = rwpng_read_header(png_ptr, info_ptr, mainprog_ptr, strip, read_data);
+#else
+    rwpng_read_header(png_ptr, info_ptr, mainprog_ptr, strip, read_data);
+#endif
+
+    // a small file can claim a huge image, so check before allocating it
+    if (mainprog_ptr->max_pixels && (uint64_t)mainprog_ptr->width * mainprog_ptr->height > mainprog_ptr->max_pixels) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return TOO_MANY_PIXELS;
+    }
+
     png_set_interlace_handling(png_ptr);
 
     /* all transformations have been registered; now update info_ptr data,
@@ -282,20 +432,28 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
     png_read_update_info(png_ptr, info_ptr);
 
     rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    mainprog_ptr->bytes_per_pixel = png_get_channels(png_ptr, info_ptr);
 
-    // For overflow safety reject images that won't fit in 32-bit
-    if (rowbytes > INT_MAX/mainprog_ptr->height) {
+    // For overflow safety reject images that can't be addressed at all
+    if (rowbytes > SIZE_MAX/mainprog_ptr->height) {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return PNG_OUT_OF_MEMORY_ERROR;
     }
 
-    if ((mainprog_ptr->rgba_data = malloc(rowbytes * mainprog_ptr->height)) == NULL) {
-        fprintf(stderr, "pngloss readpng:  unable to allocate image data\n");
+    if ((mainprog_ptr->pixel_data = rwpng_alloc_pixels(mainprog_ptr, rowbytes * mainprog_ptr->height)) == NULL) {
+        if (!mainprog_ptr->quiet) {
+            fprintf(stderr, "pngloss readpng:  unable to allocate image data\n");
+        }
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return PNG_OUT_OF_MEMORY_ERROR;
     }
 
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, false);
+    // owned by the image, so a libpng error below doesn't leak it
+    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr, false);
+    if (!row_pointers) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
 
     /* now we can go ahead and just read the whole image */
 
@@ -316,7 +474,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
 
     cmsHPROFILE hInProfile = NULL;
 
-    /* color_type is read from the image before conversion to RGBA */
+    /* color_type is read from the image before expansion */
     int COLOR_PNG = color_type & PNG_COLOR_MASK_COLOR;
 
     /* embedded ICC profile */
@@ -356,7 +514,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         WhitePoint.Y = Primaries.Red.Y = Primaries.Green.Y = Primaries.Blue.Y = 1.0;
 
         cmsToneCurve *GammaTable[3];
-        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/gamma);
+        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/mainprog_ptr->gamma);
 
         hInProfile = cmsCreateRGBProfile(&WhitePoint, &Primaries, GammaTable);
 
@@ -370,8 +528,9 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
     if (hInProfile != NULL) {
 
         cmsHPROFILE hOutProfile = cmsCreate_sRGBProfile();
-        cmsHTRANSFORM hTransform = cmsCreateTransform(hInProfile, TYPE_RGBA_8,
-                                                      hOutProfile, TYPE_RGBA_8,
+        cmsUInt32Number format = mainprog_ptr->bytes_per_pixel == 4 ? TYPE_RGBA_8 : TYPE_RGB_8;
+        cmsHTRANSFORM hTransform = cmsCreateTransform(hInProfile, format,
+                                                      hOutProfile, format,
                                                       INTENT_PERCEPTUAL,
                                                       0);
 
@@ -393,8 +552,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-    mainprog_ptr->file_size = read_data.bytes_read;
-    mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
+    mainprog_ptr->file_size = read_data->bytes_read;
 
     return SUCCESS;
 }
@@ -411,16 +569,109 @@ void rwpng_free_image24(png24_image *image)
 {
     free(image->row_pointers);
     image->row_pointers = NULL;
+    image->row_pointers_height = 0;
+
+    rwpng_free_pixels(image);
 
-    free(image->rgba_data);
-    image->rgba_data = NULL;
+    free(image->file_data);
+    image->file_data = NULL;
 
     rwpng_free_chunks(image->chunks);
     image->chunks = NULL;
 }
 
-pngloss_error rwpng_read_image24(FILE *infile, png24_image *out, bool strip, bool verbose)
+/* Narrowing picks the narrowest format that holds the pixels without loss:
+ * color that is always gray becomes gray, taking green as the luminance, and
+ * alpha that is always opaque is dropped. Both the optimizer and the writer
+ * work in the format it picks. */
+
+/* clears grayscale or strip_alpha if a pixel of the row rules them out */
+static void rwpng_check_narrow_row(unsigned char *row, uint32_t width, uint_fast8_t bytes_per_pixel, bool *grayscale, bool *strip_alpha)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        unsigned char *pixel = row + (size_t)x * bytes_per_pixel;
+        if (*grayscale && (pixel[0] != pixel[1] || pixel[1] != pixel[2])) {
+            *grayscale = false;
+        }
+        if (*strip_alpha && pixel[bytes_per_pixel - 1] < 255) {
+            *strip_alpha = false;
+        }
+    }
+}
+
+static uint_fast8_t rwpng_narrow_bytes_per_pixel(uint_fast8_t bytes_per_pixel, bool grayscale, bool strip_alpha)
 {
+    bool has_color = bytes_per_pixel >= 3;
+    bool has_alpha = bytes_per_pixel % 2 == 0;
+    return (has_color && !grayscale ? 3 : 1) + (has_alpha && !strip_alpha);
+}
+
+/* Repacks a row from one format to a narrower one. Every narrow pixel ends
+ * at or before the wide one it comes from, so narrow may be the same
+ * buffer as wide. */
+static void rwpng_narrow_row(unsigned char *wide, uint_fast8_t wide_bytes, unsigned char *narrow, uint_fast8_t narrow_bytes, uint32_t width)
+{
+    uint_fast8_t color_channels = narrow_bytes >= 3 ? 3 : 1;
+    uint_fast8_t first_channel = (wide_bytes >= 3 && narrow_bytes < 3) ? 1 : 0;
+    bool keep_alpha = narrow_bytes % 2 == 0;
+    for (uint32_t x = 0; x < width; x++) {
+        unsigned char *pixel = wide + (size_t)x * wide_bytes;
+        for (uint_fast8_t c = 0; c < color_channels; c++) {
+            *narrow++ = pixel[first_channel + c];
+        }
+        if (keep_alpha) {
+            *narrow++ = pixel[wide_bytes - 1];
+        }
+    }
+}
+
+/* the narrowest format that holds every row of a whole image */
+static uint_fast8_t rwpng_narrow_image_bytes_per_pixel(png24_image *image)
+{
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    bool grayscale = bytes_per_pixel >= 3;
+    bool strip_alpha = bytes_per_pixel % 2 == 0;
+    for (uint32_t y = 0; y < image->height && (grayscale || strip_alpha); y++) {
+        rwpng_check_narrow_row(image->row_pointers[y], image->width, bytes_per_pixel, &grayscale, &strip_alpha);
+    }
+    return rwpng_narrow_bytes_per_pixel(bytes_per_pixel, grayscale, strip_alpha);
+}
+
+static void rwpng_narrow_pixels(png24_image *image)
+{
+    uint_fast8_t narrow_bytes = rwpng_narrow_image_bytes_per_pixel(image);
+    if (narrow_bytes == image->bytes_per_pixel) {
+        return;
+    }
+
+    for (uint32_t y = 0; y < image->height; y++) {
+        unsigned char *narrow = image->pixel_data + (size_t)y * image->width * narrow_bytes;
+        rwpng_narrow_row(image->row_pointers[y], image->bytes_per_pixel, narrow, narrow_bytes, image->width);
+        image->row_pointers[y] = narrow;
+    }
+    image->bytes_per_pixel = narrow_bytes;
+}
+
+/* Optimizing can leave a colored or translucent image with nothing but gray
+ * or opaque pixels, mostly in tiny images, so whole images are narrowed once
+ * more before they are written. Each row is repacked where it is, since the
+ * rows may not be laid out in pixel_data. */
+static void rwpng_narrow_rows(png24_image *image)
+{
+    uint_fast8_t narrow_bytes = rwpng_narrow_image_bytes_per_pixel(image);
+    if (narrow_bytes == image->bytes_per_pixel) {
+        return;
+    }
+
+    for (uint32_t y = 0; y < image->height; y++) {
+        rwpng_narrow_row(image->row_pointers[y], image->bytes_per_pixel, image->row_pointers[y], narrow_bytes, image->width);
+    }
+    image->bytes_per_pixel = narrow_bytes;
+}
+
+pngloss_error rwpng_read_image24(FILE *infile, png24_image *out, bool strip, bool keep_file_data, bool verbose)
+{
+    pngloss_error retval;
 #if USE_COCOA
     rwpng_rgba *pixel_data;
     pngloss_error res = rwpng_read_image32_cocoa(infile, &out->width, &out->height, &out->file_size, &pixel_data);
@@ -430,17 +681,218 @@ pngloss_error rwpng_read_image24(FILE *infile, png24_image *out, bool strip, boo
     out->gamma = 0.45455;
     out->input_color = RWPNG_COCOA;
     out->output_color = RWPNG_SRGB;
-    out->rgba_data = (unsigned char *)pixel_data;
+    free(out->row_pointers);
+    rwpng_free_pixels(out);
+    out->pixel_data = (unsigned char *)pixel_data;
+    out->bytes_per_pixel = 4;
     out->row_pointers = malloc(sizeof(out->row_pointers[0])*out->height);
-    for(int i=0; i < out->height; i++) {
-        out->row_pointers[i] = (unsigned char *)&pixel_data[out->width*i];
+    for(uint32_t i=0; i < out->height; i++) {
+        out->row_pointers[i] = (unsigned char *)&pixel_data[(size_t)out->width*i];
     }
-    return SUCCESS;
+    retval = SUCCESS;
 #else
-    return rwpng_read_image24_libpng(infile, out, strip, verbose);
+    struct rwpng_read_data read_data = {
+        .fp = infile,
+        .bytes_read = 0,
+        .file_data = keep_file_data ? &out->file_data : NULL
+    };
+    retval = rwpng_read_image24_libpng(&read_data, out, strip, verbose);
 #endif
+    if (SUCCESS == retval) {
+        rwpng_narrow_pixels(out);
+    }
+    return retval;
+}
+
+/* Like rwpng_read_image24, for a PNG file that is already in memory. */
+pngloss_error rwpng_read_image24_buffer(const unsigned char *data, size_t size, png24_image *out, bool strip, bool verbose)
+{
+#if USE_COCOA
+    FILE *infile = fmemopen((void *)data, size, "rb");
+    if (!infile) {
+        return READ_ERROR;
+    }
+    pngloss_error retval = rwpng_read_image24(infile, out, strip, false, verbose);
+    fclose(infile);
+    return retval;
+#else
+    struct rwpng_read_data read_data = {
+        .buffer = data,
+        .buffer_size = size,
+        .bytes_read = 0
+    };
+    pngloss_error retval = rwpng_read_image24_libpng(&read_data, out, strip, verbose);
+    if (SUCCESS == retval) {
+        rwpng_narrow_pixels(out);
+    }
+    return retval;
+#endif
+}
+
+/* Row readers decode an image one row at a time, so images larger than
+ * memory can be streamed through. Rows come out in image->bytes_per_pixel
+ * format, which must be the decoded format or a narrowing of it. */
+struct rwpng_row_reader {
+    png24_image *image;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct rwpng_read_data read_data;
+    unsigned char *decoded_row;
+    uint_fast8_t decoded_bytes_per_pixel;
+    uint32_t rows_read;
+};
+
+#if !USE_COCOA
+static pngloss_error rwpng_row_reader_start(rwpng_row_reader **reader_p, FILE *infile, png24_image *image, bool strip, bool verbose)
+{
+    rwpng_row_reader *reader = calloc(1, sizeof(rwpng_row_reader));
+    if (!reader) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    *reader_p = reader;
+    reader->image = image;
+    reader->read_data.fp = infile;
+
+    reader->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, image,
+      rwpng_error_handler, verbose ? rwpng_warning_stderr_handler : rwpng_warning_silent_handler);
+    if (!reader->png_ptr) {
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+    reader->info_ptr = png_create_info_struct(reader->png_ptr);
+    if (!reader->info_ptr) {
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    if (setjmp(image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    rwpng_read_header(reader->png_ptr, reader->info_ptr, image, strip, &reader->read_data);
+
+    // interlaced rows arrive in passes over the whole image, and color
+    // profiles are applied to the whole image after it is read
+    if (png_get_interlace_type(reader->png_ptr, reader->info_ptr) != PNG_INTERLACE_NONE) {
+        return NOT_STREAMABLE;
+    }
+#if USE_LCMS
+    if (png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_iCCP) ||
+        png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_cHRM)) {
+        return NOT_STREAMABLE;
+    }
+#endif
+
+    png_read_update_info(reader->png_ptr, reader->info_ptr);
+    reader->decoded_bytes_per_pixel = png_get_channels(reader->png_ptr, reader->info_ptr);
+    if (!image->bytes_per_pixel) {
+        image->bytes_per_pixel = reader->decoded_bytes_per_pixel;
+    }
+
+    reader->decoded_row = malloc(png_get_rowbytes(reader->png_ptr, reader->info_ptr));
+    if (!reader->decoded_row) {
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/* Reads the whole image once without keeping its pixels, to find its size,
+ * metadata and the narrowest pixel format that holds it. */
+pngloss_error rwpng_scan_image24(FILE *infile, png24_image *image, bool strip, bool verbose)
+{
+    rwpng_row_reader *reader = NULL;
+    image->bytes_per_pixel = 0;
+    pngloss_error retval = rwpng_row_reader_start(&reader, infile, image, strip, verbose);
+
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    bool grayscale = bytes_per_pixel >= 3;
+    bool strip_alpha = bytes_per_pixel % 2 == 0;
+    for (uint32_t y = 0; SUCCESS == retval && y < image->height; y++) {
+        retval = rwpng_read_row(reader, reader->decoded_row);
+        if (SUCCESS == retval) {
+            rwpng_check_narrow_row(reader->decoded_row, image->width, bytes_per_pixel, &grayscale, &strip_alpha);
+        }
+    }
+
+    pngloss_error close_retval = rwpng_row_reader_close(reader);
+    if (SUCCESS == retval) {
+        retval = close_retval;
+    }
+    if (SUCCESS == retval) {
+        image->bytes_per_pixel = rwpng_narrow_bytes_per_pixel(bytes_per_pixel, grayscale, strip_alpha);
+    }
+    return retval;
+}
+
+pngloss_error rwpng_row_reader_open(rwpng_row_reader **reader_p, FILE *infile, png24_image *image, bool verbose)
+{
+    // metadata was already kept by the scan
+    return rwpng_row_reader_start(reader_p, infile, image, true, verbose);
+}
+
+pngloss_error rwpng_read_row(rwpng_row_reader *reader, unsigned char *row)
+{
+    if (setjmp(reader->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    if (reader->decoded_bytes_per_pixel == reader->image->bytes_per_pixel) {
+        png_read_row(reader->png_ptr, row, NULL);
+    } else {
+        png_read_row(reader->png_ptr, reader->decoded_row, NULL);
+        rwpng_narrow_row(reader->decoded_row, reader->decoded_bytes_per_pixel, row, reader->image->bytes_per_pixel, reader->image->width);
+    }
+    reader->rows_read++;
+    return SUCCESS;
 }
 
+/* Finishes reading the file if every row was read, which also reads any
+ * metadata after the image data, and frees the reader. */
+pngloss_error rwpng_row_reader_close(rwpng_row_reader *reader)
+{
+    if (!reader) {
+        return SUCCESS;
+    }
+
+    // set after setjmp, so it must not live in a register longjmp restores
+    volatile pngloss_error retval = SUCCESS;
+    if (reader->png_ptr && reader->info_ptr && reader->rows_read == reader->image->height) {
+        if (setjmp(reader->image->jmpbuf)) {
+            retval = LIBPNG_FATAL_ERROR;
+        } else {
+            png_read_end(reader->png_ptr, NULL);
+            reader->image->file_size = reader->read_data.bytes_read;
+        }
+    }
+
+    if (reader->png_ptr) {
+        png_destroy_read_struct(&reader->png_ptr, reader->info_ptr ? &reader->info_ptr : NULL, NULL);
+    }
+    free(reader->decoded_row);
+    free(reader);
+    return retval;
+}
+#else
+pngloss_error rwpng_scan_image24(FILE *infile, png24_image *image, bool strip, bool verbose)
+{
+    return NOT_STREAMABLE;
+}
+
+pngloss_error rwpng_row_reader_open(rwpng_row_reader **reader_p, FILE *infile, png24_image *image, bool verbose)
+{
+    return NOT_STREAMABLE;
+}
+
+pngloss_error rwpng_read_row(rwpng_row_reader *reader, unsigned char *row)
+{
+    return NOT_STREAMABLE;
+}
+
+pngloss_error rwpng_row_reader_close(rwpng_row_reader *reader)
+{
+    return SUCCESS;
+}
+#endif
+
 
 static pngloss_error rwpng_write_image_init(png24_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, bool fast_compression)
 {
@@ -474,34 +926,6 @@ static pngloss_error rwpng_write_image_init(png24_image *mainprog_ptr, png_struc
     return SUCCESS;
 }
 
-static void rwpng_write_end(
-    png_infopp info_ptr_p, png_structpp png_ptr_p, png_bytepp row_pointers,
-    unsigned char *row_filters, uint32_t height, bool strip_alpha
-) {
-    png_write_info(*png_ptr_p, *info_ptr_p);
-
-    if (strip_alpha) {
-        png_set_filler(*png_ptr_p, 0, PNG_FILLER_AFTER);
-    }
-    png_set_packing(*png_ptr_p);
-
-    png_set_filter(*png_ptr_p, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
-    if (row_filters) {
-        png_write_row(*png_ptr_p, row_pointers[0]);
-        for (uint32_t y = 1; y < height; y++) {
-            //fprintf(stderr, "  row %u filter is 0x%X\n", (unsigned int)y, (unsigned int)row_filters[y]);
-            png_set_filter(*png_ptr_p, PNG_FILTER_TYPE_BASE, row_filters[y]);
-            png_write_row(*png_ptr_p, row_pointers[y]);
-        }
-    } else {
-        png_write_image(*png_ptr_p, row_pointers);
-    }
-
-    png_write_end(*png_ptr_p, NULL);
-
-    png_destroy_write_struct(png_ptr_p, info_ptr_p);
-}
-
 static void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamma, rwpng_color_transform color)
 {
     if (color != RWPNG_GAMA_ONLY && color != RWPNG_NONE) {
@@ -512,24 +936,37 @@ static void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamm
     }
 }
 
-pngloss_error rwpng_write_image24(
-    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters
-) {
+/* Row writers encode an image one row at a time. */
+struct rwpng_row_writer {
+    png24_image *image;
     png_structp png_ptr;
     png_infop info_ptr;
+    struct rwpng_write_state write_state;
+    uint32_t rows_written;
+    bool wrote_idat; // image data was deflated here instead of by libpng
+};
+
+static pngloss_error rwpng_row_writer_start(rwpng_row_writer **writer_p, png24_image *mainprog_ptr, struct rwpng_write_state write_state)
+{
+    rwpng_row_writer *writer = calloc(1, sizeof(rwpng_row_writer));
+    if (!writer) {
+        free(write_state.held);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    *writer_p = writer;
+    writer->image = mainprog_ptr;
+    writer->write_state = write_state;
 
-    pngloss_error retval = rwpng_write_image_init((png24_image *)mainprog_ptr, &png_ptr, &info_ptr, false);
+    pngloss_error retval = rwpng_write_image_init(mainprog_ptr, &writer->png_ptr, &writer->info_ptr, false);
     if (retval) return retval;
 
-    png_init_io(png_ptr, outfile);
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
 
-    struct rwpng_write_state write_state;
-    write_state = (struct rwpng_write_state){
-        .outfile = outfile,
-        .maximum_file_size = mainprog_ptr->maximum_file_size,
-        .retval = SUCCESS,
-    };
-    png_set_write_fn(png_ptr, &write_state, user_write_data, user_flush_data);
+    png_structp png_ptr = writer->png_ptr;
+    png_infop info_ptr = writer->info_ptr;
+    png_set_write_fn(png_ptr, &writer->write_state, user_write_data, user_flush_data);
 
     rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma, mainprog_ptr->output_color);
 
@@ -554,86 +991,624 @@ pngloss_error rwpng_write_image24(
         chunk_num++;
     }
 
-    // autodetect grayscale and alpha
-    bool grayscale = true;
-    bool strip_alpha = true;
-    for (uint32_t y = 0; y < mainprog_ptr->height; y++) {
-        for (uint32_t x = 0; x < mainprog_ptr->width; x++) {
-            unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
-            if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
-                grayscale = false;
+    // the reader, or rwpng_narrow_rows for whole images, already picked the
+    // narrowest pixel format
+    static const int color_types[] = {
+        PNG_COLOR_TYPE_GRAY,
+        PNG_COLOR_TYPE_GRAY_ALPHA,
+        PNG_COLOR_TYPE_RGB,
+        PNG_COLOR_TYPE_RGB_ALPHA
+    };
+    png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
+                 8, color_types[mainprog_ptr->bytes_per_pixel - 1],
+                 0, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    png_write_info(png_ptr, info_ptr);
+    png_set_packing(png_ptr);
+
+    return SUCCESS;
+}
+
+pngloss_error rwpng_row_writer_open(rwpng_row_writer **writer_p, FILE *outfile, png24_image *mainprog_ptr)
+{
+    // A file that turns out too large must not reach stdout at all, so hold
+    // the output back until it has all fit. Other files are written to a
+    // temporary file, which is simply deleted.
+    unsigned char *held = NULL;
+    if (mainprog_ptr->maximum_file_size && outfile == stdout) {
+        held = malloc(mainprog_ptr->maximum_file_size);
+        if (!held) {
+            *writer_p = NULL;
+            return OUT_OF_MEMORY_ERROR;
+        }
+    }
+    return rwpng_row_writer_start(writer_p, mainprog_ptr, (struct rwpng_write_state){
+        .outfile = outfile,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .held = held,
+        .retval = SUCCESS,
+    });
+}
+
+/* Writes the next row with a PNG filter, or lets libpng pick one when filter
+ * is 0. The first row is always filtered adaptively. */
+pngloss_error rwpng_write_row(rwpng_row_writer *writer, unsigned char *row, unsigned char filter)
+{
+    if (setjmp(writer->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    if (!writer->rows_written || !filter) {
+        filter = PNG_ALL_FILTERS;
+    }
+    //fprintf(stderr, "  row %u filter is 0x%X\n", (unsigned int)writer->rows_written, (unsigned int)filter);
+    png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, filter);
+    png_write_row(writer->png_ptr, row);
+    writer->rows_written++;
+    return SUCCESS;
+}
+
+/* Finishes the file if every row was written and frees the writer. */
+pngloss_error rwpng_row_writer_close(rwpng_row_writer *writer)
+{
+    if (!writer) {
+        return SUCCESS;
+    }
+
+    png24_image *mainprog_ptr = writer->image;
+    struct rwpng_write_state *write_state = &writer->write_state;
+    pngloss_error retval = SUCCESS;
+    if (!writer->png_ptr || writer->rows_written != mainprog_ptr->height) {
+        retval = LIBPNG_FATAL_ERROR;
+    } else if (setjmp(mainprog_ptr->jmpbuf)) {
+        retval = LIBPNG_FATAL_ERROR;
+    } else if (writer->wrote_idat) {
+        // libpng didn't see the image data, so it can't finish the file
+        for (struct rwpng_chunk *chunk = mainprog_ptr->chunks; chunk; chunk = chunk->next) {
+            if (chunk->location & PNG_AFTER_IDAT) {
+                png_write_chunk(writer->png_ptr, chunk->name, chunk->data, chunk->size);
             }
-            if (pixel[3] < 255) {
-                strip_alpha = false;
+        }
+        png_write_chunk(writer->png_ptr, (png_const_bytep)"IEND", NULL, 0);
+    } else {
+        png_write_end(writer->png_ptr, NULL);
+    }
+    if (writer->png_ptr) {
+        png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    }
+
+    if (SUCCESS == retval && SUCCESS == write_state->retval && write_state->held) {
+        if (!fwrite(write_state->held, write_state->bytes_written, 1, write_state->outfile)) {
+            write_state->retval = CANT_WRITE_ERROR;
+        }
+    }
+    free(write_state->held);
+
+    if (SUCCESS == retval) {
+        if (SUCCESS == write_state->retval && write_state->maximum_file_size && write_state->bytes_written > write_state->maximum_file_size) {
+            retval = TOO_LARGE_FILE;
+        } else if (SUCCESS != write_state->retval) {
+            retval = write_state->retval;
+        } else {
+            mainprog_ptr->file_size = write_state->bytes_written;
+        }
+    }
+    free(writer);
+    return retval;
+}
+
+/* With more than one thread, the image data is split into blocks of rows
+ * that are deflated independently and joined into one zlib stream, the way
+ * pigz does it. Each block starts from the last 32KB of filtered data before
+ * it as its dictionary, so little is lost at the seams. */
+#define RWPNG_DEFLATE_BLOCK_SIZE (128 * 1024)
+#define RWPNG_DEFLATE_DICTIONARY_SIZE 32768
+
+typedef struct {
+    png24_image *image;
+    unsigned char *row_filters;
+    size_t rowbytes;
+    uint32_t rows_per_block;
+    uint32_t block_count;
+    uint32_t first_block;
+    unsigned char **output;
+    size_t *output_size;
+    uLong *adler;
+    size_t *input_size;
+    pngloss_error *results;
+} rwpng_deflate_job;
+
+static pngloss_filter rwpng_row_filter(unsigned char *row_filters, pngloss_image *image, uint32_t y)
+{
+    unsigned char filter = row_filters ? row_filters[y] : 0;
+    switch (y ? filter : 0) {
+    case PNG_FILTER_NONE:
+        return pngloss_none;
+    case PNG_FILTER_SUB:
+        return pngloss_sub;
+    case PNG_FILTER_UP:
+        return pngloss_up;
+    case PNG_FILTER_AVG:
+        return pngloss_average;
+    case PNG_FILTER_PAETH:
+        return pngloss_paeth;
+    default:
+        // the first row, and rows without a filter, are filtered adaptively
+        return adaptive_filter_for_rows(image, y ? image->rows[y - 1] : NULL, image->rows[y]);
+    }
+}
+
+/* Filters rows first_y up to but not including end_y into filtered the way
+ * they are stored in the image data, each after its filter type byte. */
+static void rwpng_filter_rows(png24_image *mainprog_ptr, unsigned char *row_filters, uint32_t first_y, uint32_t end_y, unsigned char *filtered)
+{
+    pngloss_image image = {
+        .rows = mainprog_ptr->row_pointers,
+        .width = mainprog_ptr->width,
+        .height = mainprog_ptr->height,
+        .bytes_per_pixel = mainprog_ptr->bytes_per_pixel
+    };
+    size_t filtered_rowbytes = (size_t)image.width * image.bytes_per_pixel + 1;
+    for (uint32_t y = first_y; y < end_y; y++) {
+        unsigned char *row = filtered + (size_t)(y - first_y) * filtered_rowbytes;
+        pngloss_filter filter = rwpng_row_filter(row_filters, &image, y);
+        row[0] = filter;
+        filter_row(&image, y ? image.rows[y - 1] : NULL, image.rows[y], filter, row + 1);
+    }
+}
+
+/* Writes a zlib stream as IDAT chunks, as few as the chunk size allows. */
+static void rwpng_write_idat(png_structp png_ptr, unsigned char *data, size_t size)
+{
+    for (size_t offset = 0; offset < size;) {
+        size_t length = size - offset < PNG_UINT_31_MAX ? size - offset : PNG_UINT_31_MAX;
+        png_write_chunk(png_ptr, (png_const_bytep)"IDAT", data + offset, length);
+        offset += length;
+    }
+}
+
+static void rwpng_deflate_block(void *context, uint32_t index)
+{
+    rwpng_deflate_job *job = context;
+    uint32_t block = job->first_block + index;
+    png24_image *mainprog_ptr = job->image;
+    size_t filtered_rowbytes = job->rowbytes + 1;
+    uint32_t start_y = block * job->rows_per_block;
+    uint32_t end_y = start_y + job->rows_per_block;
+    if (end_y > mainprog_ptr->height) {
+        end_y = mainprog_ptr->height;
+    }
+    // filter enough rows before the block to fill the dictionary
+    uint32_t dictionary_rows = (RWPNG_DEFLATE_DICTIONARY_SIZE + filtered_rowbytes - 1) / filtered_rowbytes;
+    if (dictionary_rows > start_y) {
+        dictionary_rows = start_y;
+    }
+    uint32_t first_y = start_y - dictionary_rows;
+
+    size_t input_size = (size_t)(end_y - start_y) * filtered_rowbytes;
+    size_t dictionary_size = (size_t)dictionary_rows * filtered_rowbytes;
+    unsigned char *filtered = malloc(dictionary_size + input_size);
+    if (!filtered) {
+        job->results[index] = OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    rwpng_filter_rows(mainprog_ptr, job->row_filters, first_y, end_y, filtered);
+    unsigned char *input = filtered + dictionary_size;
+
+    z_stream stream = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+    bool last_block = (block + 1 == job->block_count);
+    size_t output_capacity = input_size + input_size / 1000 + 64;
+    unsigned char *output = malloc(output_capacity);
+    int err = output ? deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_FILTERED) : Z_MEM_ERROR;
+    if (Z_OK == err && dictionary_size) {
+        size_t used = dictionary_size < RWPNG_DEFLATE_DICTIONARY_SIZE ? dictionary_size : RWPNG_DEFLATE_DICTIONARY_SIZE;
+        err = deflateSetDictionary(&stream, input - used, (uInt)used);
+    }
+    if (Z_OK == err) {
+        // feed and drain in pieces that fit zlib's 32 bit counts
+        size_t consumed = 0, produced = 0;
+        int flush = Z_NO_FLUSH;
+        while (Z_OK == err && flush != (last_block ? Z_FINISH : Z_SYNC_FLUSH)) {
+            if (produced == output_capacity) {
+                output_capacity *= 2;
+                unsigned char *grown = realloc(output, output_capacity);
+                if (!grown) {
+                    err = Z_MEM_ERROR;
+                    break;
+                }
+                output = grown;
+            }
+            size_t in = input_size - consumed < UINT_MAX ? input_size - consumed : UINT_MAX;
+            size_t out = output_capacity - produced < UINT_MAX ? output_capacity - produced : UINT_MAX;
+            stream.next_in = input + consumed;
+            stream.avail_in = (uInt)in;
+            stream.next_out = output + produced;
+            stream.avail_out = (uInt)out;
+            if (consumed + in == input_size) {
+                flush = last_block ? Z_FINISH : Z_SYNC_FLUSH;
+            }
+            err = deflate(&stream, flush);
+            consumed += in - stream.avail_in;
+            produced += out - stream.avail_out;
+            if (Z_BUF_ERROR == err || (Z_OK == err && !stream.avail_out)) {
+                // out of room, so go around again without finishing
+                err = Z_OK;
+                flush = Z_NO_FLUSH;
+            } else if (Z_STREAM_END == err) {
+                err = Z_OK;
             }
         }
-        if (!grayscale && !strip_alpha) {
-            break;
+        deflateEnd(&stream);
+        job->output_size[index] = produced;
+    }
+    if (Z_OK == err) {
+        job->output[index] = output;
+        // adler32 takes 32 bit lengths too
+        job->adler[index] = adler32(0L, Z_NULL, 0);
+        for (size_t done = 0; done < input_size;) {
+            uInt length = input_size - done < UINT_MAX ? (uInt)(input_size - done) : UINT_MAX;
+            job->adler[index] = adler32(job->adler[index], input + done, length);
+            done += length;
         }
+        job->input_size[index] = input_size;
+        job->results[index] = SUCCESS;
+    } else {
+        free(output);
+        job->results[index] = OUT_OF_MEMORY_ERROR;
     }
+    free(filtered);
+}
 
-    // saving grayscale requires different pixel format
-    unsigned char *gray_data = NULL;
-    if (grayscale) {
-        uint32_t width = mainprog_ptr->width;
-        uint32_t height = mainprog_ptr->height;
-        uint32_t rowbytes = width * 2;
-        gray_data = malloc(rowbytes * height);
-        if (gray_data) {
-            for (uint32_t y = 0; y < height; y++) {
-                for (uint32_t x = 0; x < width; x++) {
-                    unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
-                    // green to luminance and alpha to alpha
-                    gray_data[y*rowbytes + x*2 + 0] = pixel[1];
-                    gray_data[y*rowbytes + x*2 + 1] = pixel[3];
+/* Writes the image data of an open writer as IDAT chunks, deflating a few
+ * blocks per thread at a time so that only their output is held. */
+static pngloss_error rwpng_write_idat_parallel(
+    rwpng_row_writer *writer, unsigned char *row_filters, uint_fast16_t thread_count
+) {
+    png24_image *mainprog_ptr = writer->image;
+    size_t rowbytes = (size_t)mainprog_ptr->width * mainprog_ptr->bytes_per_pixel;
+    uint32_t rows_per_block = RWPNG_DEFLATE_BLOCK_SIZE / (rowbytes + 1);
+    if (rows_per_block < 1) {
+        rows_per_block = 1;
+    }
+    uint32_t block_count = mainprog_ptr->height / rows_per_block + (mainprog_ptr->height % rows_per_block != 0);
+    uint32_t batch_size = thread_count * 4;
+
+    rwpng_deflate_job job = {
+        .image = mainprog_ptr,
+        .row_filters = row_filters,
+        .rowbytes = rowbytes,
+        .rows_per_block = rows_per_block,
+        .block_count = block_count,
+        .output = calloc(batch_size, sizeof(unsigned char *)),
+        .output_size = calloc(batch_size, sizeof(size_t)),
+        .adler = calloc(batch_size, sizeof(uLong)),
+        .input_size = calloc(batch_size, sizeof(size_t)),
+        .results = calloc(batch_size, sizeof(pngloss_error))
+    };
+    // both are read after a longjmp back to the setjmp below, so they must
+    // not live in registers
+    volatile pngloss_error retval = SUCCESS;
+    if (!job.output || !job.output_size || !job.adler || !job.input_size || !job.results) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    thread_pool pool;
+    volatile bool pool_started = false;
+    if (SUCCESS == retval) {
+        retval = thread_pool_init(&pool, thread_count);
+        pool_started = (SUCCESS == retval);
+    }
+
+    // level 9 with a 32KB window, as every block was deflated
+    static const unsigned char zlib_header[2] = {0x78, 0xDA};
+    uLong adler = adler32(0L, Z_NULL, 0);
+    png_structp png_ptr = writer->png_ptr;
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        retval = LIBPNG_FATAL_ERROR;
+    }
+    while (SUCCESS == retval && job.first_block < block_count) {
+        uint32_t count = block_count - job.first_block < batch_size ? block_count - job.first_block : batch_size;
+        thread_pool_run(&pool, rwpng_deflate_block, count, &job);
+
+        for (uint32_t index = 0; index < count; index++) {
+            if (SUCCESS != job.results[index]) {
+                retval = job.results[index];
+            }
+        }
+        for (uint32_t index = 0; SUCCESS == retval && index < count; index++) {
+            uint32_t block = job.first_block + index;
+            unsigned char *output = job.output[index];
+            size_t size = job.output_size[index];
+            adler = adler32_combine(adler, job.adler[index], (z_off_t)job.input_size[index]);
+            if (!block) {
+                // the header rides in front of the first block
+                unsigned char *grown = realloc(output, size + sizeof(zlib_header));
+                if (!grown) {
+                    retval = OUT_OF_MEMORY_ERROR;
+                    break;
                 }
+                output = job.output[index] = grown;
+                memmove(output + sizeof(zlib_header), output, size);
+                memcpy(output, zlib_header, sizeof(zlib_header));
+                size += sizeof(zlib_header);
             }
-        } else {
-            grayscale = false;
+            if (block + 1 == block_count) {
+                unsigned char *grown = realloc(output, size + 4);
+                if (!grown) {
+                    retval = OUT_OF_MEMORY_ERROR;
+                    break;
+                }
+                output = job.output[index] = grown;
+                output[size++] = (adler >> 24) & 0xFF;
+                output[size++] = (adler >> 16) & 0xFF;
+                output[size++] = (adler >> 8) & 0xFF;
+                output[size++] = adler & 0xFF;
+            }
+            rwpng_write_idat(png_ptr, output, size);
+        }
+        for (uint32_t index = 0; index < count; index++) {
+            free(job.output[index]);
+            job.output[index] = NULL;
         }
+        job.first_block += count;
     }
 
-    int color_type;
-    if (grayscale) {
-        if (strip_alpha) {
-            color_type = PNG_COLOR_TYPE_GRAY;
-        } else {
-            color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+    if (pool_started) {
+        thread_pool_destroy(&pool);
+    }
+    if (job.output) {
+        for (uint32_t index = 0; index < batch_size; index++) {
+            free(job.output[index]);
         }
-    } else {
-        if (strip_alpha) {
-            color_type = PNG_COLOR_TYPE_RGB;
+    }
+    free(job.output);
+    free(job.output_size);
+    free(job.adler);
+    free(job.input_size);
+    free(job.results);
+
+    if (SUCCESS == retval) {
+        writer->rows_written = mainprog_ptr->height;
+        writer->wrote_idat = true;
+    }
+    return retval;
+}
+
+/* Encode trials deflate the whole image data once per configuration, at
+ * the same time on the thread pool, and keep the smallest. They are in
+ * order of how often they win, so fewer trials still try the likely ones.
+ * Smaller windows never compress better, so only full windows are tried. */
+typedef struct {
+    int mem_level;
+    int strategy;
+    const char *name;
+} rwpng_deflate_config;
+
+static const rwpng_deflate_config rwpng_deflate_configs[] = {
+    {8, Z_FILTERED, "filtered strategy, mem level 8"},
+    {9, Z_FILTERED, "filtered strategy, mem level 9"},
+    {9, Z_RLE, "run length strategy"},
+    {8, Z_DEFAULT_STRATEGY, "default strategy, mem level 8"},
+    {9, Z_DEFAULT_STRATEGY, "default strategy, mem level 9"},
+    {9, Z_HUFFMAN_ONLY, "Huffman only strategy"},
+};
+
+/* Trials filter the rows again a block at a time instead of sharing one
+ * filtered copy of the image, and only the smallest finished stream is
+ * kept. A trial gives up as soon as its output is larger than that, so at
+ * most one stream per thread is in memory besides the best. */
+typedef struct {
+    png24_image *image;
+    unsigned char *row_filters;
+    uint32_t rows_per_block;
+    pthread_mutex_t mutex;
+    int best; // trial that made best_output, or -1
+    unsigned char *best_output;
+    size_t best_size;
+} rwpng_trial_job;
+
+static bool rwpng_trial_losing(rwpng_trial_job *job, size_t produced)
+{
+    pthread_mutex_lock(&job->mutex);
+    bool losing = job->best >= 0 && produced > job->best_size;
+    pthread_mutex_unlock(&job->mutex);
+    return losing;
+}
+
+static void rwpng_deflate_trial(void *context, uint32_t index)
+{
+    rwpng_trial_job *job = context;
+    const rwpng_deflate_config *config = &rwpng_deflate_configs[index];
+    png24_image *mainprog_ptr = job->image;
+    size_t filtered_rowbytes = (size_t)mainprog_ptr->width * mainprog_ptr->bytes_per_pixel + 1;
+
+    z_stream stream = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+    if (Z_OK != deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15, config->mem_level, config->strategy)) {
+        return;
+    }
+    unsigned char *filtered = malloc(job->rows_per_block * filtered_rowbytes);
+    size_t capacity = RWPNG_DEFLATE_BLOCK_SIZE;
+    unsigned char *output = malloc(capacity);
+    size_t produced = 0;
+    int err = (filtered && output) ? Z_OK : Z_MEM_ERROR;
+    for (uint32_t y = 0; Z_OK == err && y < mainprog_ptr->height; y += job->rows_per_block) {
+        uint32_t end_y = mainprog_ptr->height - y < job->rows_per_block ? mainprog_ptr->height : y + job->rows_per_block;
+        rwpng_filter_rows(mainprog_ptr, job->row_filters, y, end_y, filtered);
+        size_t input_size = (end_y - y) * filtered_rowbytes, consumed = 0;
+        int flush = Z_NO_FLUSH;
+        // feed and drain in pieces that fit zlib's 32 bit counts, until the
+        // block is consumed or the stream ends
+        do {
+            if (!stream.avail_in && consumed < input_size) {
+                size_t in = input_size - consumed < UINT_MAX ? input_size - consumed : UINT_MAX;
+                stream.next_in = filtered + consumed;
+                stream.avail_in = (uInt)in;
+                consumed += in;
+                if (consumed == input_size && end_y == mainprog_ptr->height) {
+                    flush = Z_FINISH;
+                }
+            }
+            if (produced == capacity) {
+                capacity *= 2;
+                unsigned char *grown = realloc(output, capacity);
+                if (!grown) {
+                    err = Z_MEM_ERROR;
+                    break;
+                }
+                output = grown;
+            }
+            size_t out = capacity - produced < UINT_MAX ? capacity - produced : UINT_MAX;
+            stream.next_out = output + produced;
+            stream.avail_out = (uInt)out;
+            err = deflate(&stream, flush);
+            produced += out - stream.avail_out;
+            if (Z_BUF_ERROR == err) {
+                err = Z_OK;
+            }
+        } while (Z_OK == err && (stream.avail_in || consumed < input_size || Z_FINISH == flush));
+        if (Z_OK == err && rwpng_trial_losing(job, produced)) {
+            err = Z_DATA_ERROR;
+        }
+    }
+    deflateEnd(&stream);
+    free(filtered);
+
+    // ties go to the earlier trial, whichever order they finish in
+    if (Z_STREAM_END == err) {
+        pthread_mutex_lock(&job->mutex);
+        if (job->best < 0 || produced < job->best_size || (produced == job->best_size && (int)index < job->best)) {
+            unsigned char *beaten = job->best_output;
+            job->best = index;
+            job->best_output = output;
+            job->best_size = produced;
+            output = beaten;
+        }
+        pthread_mutex_unlock(&job->mutex);
+    }
+    free(output);
+}
+
+/* Writes the image data of an open writer with whichever of trial_count
+ * encode trials turned out smallest. */
+static pngloss_error rwpng_write_idat_trials(
+    rwpng_row_writer *writer, unsigned char *row_filters,
+    uint_fast16_t thread_count, uint_fast8_t trial_count
+) {
+    png24_image *mainprog_ptr = writer->image;
+    if (trial_count > RWPNG_DEFLATE_TRIALS_MAX) {
+        trial_count = RWPNG_DEFLATE_TRIALS_MAX;
+    }
+    if (thread_count > trial_count) {
+        thread_count = trial_count;
+    }
+
+    size_t filtered_rowbytes = (size_t)mainprog_ptr->width * mainprog_ptr->bytes_per_pixel + 1;
+    rwpng_trial_job job = {
+        .image = mainprog_ptr,
+        .row_filters = row_filters,
+        .rows_per_block = RWPNG_DEFLATE_BLOCK_SIZE / filtered_rowbytes,
+        .best = -1
+    };
+    if (job.rows_per_block < 1) {
+        job.rows_per_block = 1;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+
+    thread_pool pool;
+    pngloss_error retval = thread_pool_init(&pool, thread_count);
+    if (SUCCESS == retval) {
+        thread_pool_run(&pool, rwpng_deflate_trial, trial_count, &job);
+        thread_pool_destroy(&pool);
+    }
+    pthread_mutex_destroy(&job.mutex);
+    if (SUCCESS == retval && job.best < 0) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    if (SUCCESS == retval) {
+        if (setjmp(mainprog_ptr->jmpbuf)) {
+            retval = LIBPNG_FATAL_ERROR;
         } else {
-            color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+            rwpng_write_idat(writer->png_ptr, job.best_output, job.best_size);
+            writer->rows_written = mainprog_ptr->height;
+            writer->wrote_idat = true;
+            mainprog_ptr->deflate_config = rwpng_deflate_configs[job.best].name;
         }
     }
-    png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
-                 8, color_type,
-                 0, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
 
-    unsigned char *base;
-    png_size_t rowbytes;
-    if (grayscale) {
-        base = gray_data;
-        rowbytes = mainprog_ptr->width * 2;
-    } else {
-        base = mainprog_ptr->rgba_data;
-        rowbytes = mainprog_ptr->width * 4;
+    free(job.best_output);
+    return retval;
+}
+
+/* Writes every row of an image through a writer that was just opened with
+ * retval, then closes it. */
+static pngloss_error rwpng_write_rows(
+    rwpng_row_writer *writer, pngloss_error retval, png24_image *mainprog_ptr,
+    unsigned char *row_filters, uint_fast16_t thread_count,
+    uint_fast8_t deflate_trials
+) {
+    size_t rowbytes = (size_t)mainprog_ptr->width * mainprog_ptr->bytes_per_pixel;
+    if (SUCCESS == retval && deflate_trials > 1) {
+        retval = rwpng_write_idat_trials(writer, row_filters, thread_count, deflate_trials);
+    } else if (SUCCESS == retval && mainprog_ptr->parallel_deflate && thread_count > 1 && (rowbytes + 1) * mainprog_ptr->height > 2 * RWPNG_DEFLATE_BLOCK_SIZE) {
+        retval = rwpng_write_idat_parallel(writer, row_filters, thread_count);
+    }
+    for (uint32_t y = writer ? writer->rows_written : 0; SUCCESS == retval && y < mainprog_ptr->height; y++) {
+        retval = rwpng_write_row(writer, mainprog_ptr->row_pointers[y], row_filters ? row_filters[y] : 0);
     }
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, base, mainprog_ptr->height, rowbytes);
 
-    rwpng_write_end(&info_ptr, &png_ptr, row_pointers, row_filters, mainprog_ptr->height, strip_alpha);
+    pngloss_error close_retval = rwpng_row_writer_close(writer);
+    if (SUCCESS == retval) {
+        retval = close_retval;
+    }
+    return retval;
+}
 
-    free(row_pointers);
-    free(gray_data);
+/* Writes a whole image in the narrowest format its pixels allow, repacking
+ * the rows in place first if that is narrower than bytes_per_pixel. */
+pngloss_error rwpng_write_image24(
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    uint_fast16_t thread_count, uint_fast8_t deflate_trials
+) {
+    rwpng_row_writer *writer = NULL;
+    mainprog_ptr->deflate_config = NULL;
+    rwpng_narrow_rows(mainprog_ptr);
+    pngloss_error retval = rwpng_row_writer_open(&writer, outfile, mainprog_ptr);
+    return rwpng_write_rows(writer, retval, mainprog_ptr, row_filters, thread_count, deflate_trials);
+}
 
-    if (SUCCESS == write_state.retval && write_state.maximum_file_size && write_state.bytes_written > write_state.maximum_file_size) {
-        return TOO_LARGE_FILE;
+/* Like rwpng_write_image24, but the file goes to a new buffer in *data_p of
+ * mainprog_ptr->file_size bytes, which the caller frees. size_hint is how
+ * large the file is likely to be, such as the size of the original. */
+pngloss_error rwpng_write_image24_buffer(
+    unsigned char **data_p, size_t size_hint, png24_image *mainprog_ptr,
+    unsigned char *row_filters, uint_fast16_t thread_count,
+    uint_fast8_t deflate_trials
+) {
+    *data_p = NULL;
+    if (mainprog_ptr->maximum_file_size && size_hint > mainprog_ptr->maximum_file_size) {
+        size_hint = mainprog_ptr->maximum_file_size;
+    }
+    struct rwpng_write_state write_state = {
+        .buffer = data_p,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    if (size_hint) {
+        *data_p = malloc(size_hint);
+        write_state.buffer_capacity = *data_p ? size_hint : 0;
     }
 
-    mainprog_ptr->file_size = write_state.bytes_written;
-    return SUCCESS;
+    rwpng_row_writer *writer = NULL;
+    mainprog_ptr->deflate_config = NULL;
+    rwpng_narrow_rows(mainprog_ptr);
+    pngloss_error retval = rwpng_row_writer_start(&writer, mainprog_ptr, write_state);
+    retval = rwpng_write_rows(writer, retval, mainprog_ptr, row_filters, thread_count, deflate_trials);
+    if (SUCCESS != retval) {
+        free(*data_p);
+        *data_p = NULL;
+    }
+    return retval;
 }
 
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg)
@@ -649,11 +1624,13 @@ static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg)
      * regardless of whether _BSD_SOURCE or anything else has (or has not)
      * been defined. */
 
-    fprintf(stderr, "  error: %s (libpng failed)\n", msg);
-    fflush(stderr);
-
     mainprog_ptr = png_get_error_ptr(png_ptr);
     if (mainprog_ptr == NULL) abort();
 
+    if (!mainprog_ptr->quiet) {
+        fprintf(stderr, "  error: %s (libpng failed)\n", msg);
+        fflush(stderr);
+    }
+
     longjmp(mainprog_ptr->jmpbuf, 1);
 }
@@ -16,27 +16,12 @@
 #include <stddef.h>
 #include <setjmp.h>
 
+#include "libpngloss.h"
+
 #ifndef USE_COCOA
 #define USE_COCOA 0
 #endif
 
-typedef enum {
-    SUCCESS = 0,
-    MISSING_ARGUMENT = 1,
-    READ_ERROR = 2,
-    INVALID_ARGUMENT = 4,
-    NOT_OVERWRITING_ERROR = 15,
-    CANT_WRITE_ERROR = 16,
-    OUT_OF_MEMORY_ERROR = 17,
-    WRONG_ARCHITECTURE = 18, // Missing SSE
-    PNG_OUT_OF_MEMORY_ERROR = 24,
-    LIBPNG_FATAL_ERROR = 25,
-    WRONG_INPUT_COLOR_TYPE = 26,
-    LIBPNG_INIT_ERROR = 35,
-    TOO_LARGE_FILE = 98,
-    TOO_LOW_QUALITY = 99,
-} pngloss_error;
-
 typedef struct rwpng_rgba {
   unsigned char r,g,b,a;
 } rwpng_rgba;
@@ -68,22 +53,67 @@ typedef struct {
     size_t metadata_size;
     double gamma;
     unsigned char **row_pointers;
-    unsigned char *rgba_data;
+    unsigned char *pixel_data;
+    size_t row_pointers_height; // rows row_pointers has room for
+    size_t pixel_data_size; // bytes pixel_data has room for
+    uint_fast8_t bytes_per_pixel; // 1 gray, 2 gray+alpha, 3 RGB, 4 RGBA
+    unsigned char *file_data; // file_size bytes of the PNG as read, if kept
+    size_t spill_size; // pixels larger than this go in a scratch file, 0 never
+    uint64_t max_pixels; // refuse to decode larger images, 0 for no limit
+    size_t mapped_size; // pixel_data is a mapped scratch file this large, or 0
+    const char *deflate_config; // the encode trial that was kept, if any
+    bool quiet; // don't print libpng errors, for library callers
+    bool parallel_deflate; // deflate in independent blocks on several threads
     struct rwpng_chunk *chunks;
     rwpng_color_transform input_color;
     rwpng_color_transform output_color;
 } png24_image;
 
+// how many zlib configurations rwpng_write_image24 can try
+#define RWPNG_DEFLATE_TRIALS_MAX 6
+
 /* prototypes for public functions in rwpng.c */
 
 void rwpng_version_info(FILE *fp);
 
 pngloss_error rwpng_read_image24(
-    FILE *infile, png24_image *mainprog_ptr, bool strip, bool verbose
+    FILE *infile, png24_image *mainprog_ptr, bool strip, bool keep_file_data,
+    bool verbose
 );
 pngloss_error rwpng_write_image24(
-    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    uint_fast16_t thread_count, uint_fast8_t deflate_trials
+);
+pngloss_error rwpng_read_image24_buffer(
+    const unsigned char *data, size_t size, png24_image *mainprog_ptr,
+    bool strip, bool verbose
+);
+pngloss_error rwpng_write_image24_buffer(
+    unsigned char **data_p, size_t size_hint, png24_image *mainprog_ptr,
+    unsigned char *row_filters, uint_fast16_t thread_count,
+    uint_fast8_t deflate_trials
 );
 void rwpng_free_image24(png24_image *);
 
+// row by row reading and writing, for images too large to hold in memory
+typedef struct rwpng_row_reader rwpng_row_reader;
+typedef struct rwpng_row_writer rwpng_row_writer;
+
+pngloss_error rwpng_scan_image24(
+    FILE *infile, png24_image *mainprog_ptr, bool strip, bool verbose
+);
+pngloss_error rwpng_row_reader_open(
+    rwpng_row_reader **reader_p, FILE *infile, png24_image *mainprog_ptr,
+    bool verbose
+);
+pngloss_error rwpng_read_row(rwpng_row_reader *reader, unsigned char *row);
+pngloss_error rwpng_row_reader_close(rwpng_row_reader *reader);
+pngloss_error rwpng_row_writer_open(
+    rwpng_row_writer **writer_p, FILE *outfile, png24_image *mainprog_ptr
+);
+pngloss_error rwpng_write_row(
+    rwpng_row_writer *writer, unsigned char *row, unsigned char filter
+);
+pngloss_error rwpng_row_writer_close(rwpng_row_writer *writer);
+
 #endif
@@ -0,0 +1,138 @@
+/*
+** © 2020 by William MacKay.
+**
+** See COPYRIGHT file for license.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "thread_pool.h"
+
+// Claims and runs tasks until none are left. Called and returns with the
+// pool mutex held.
+static void thread_pool_work(thread_pool *pool) {
+    while (pool->next_index < pool->task_count) {
+        uint32_t index = pool->next_index++;
+        thread_pool_task task = pool->task;
+        void *context = pool->context;
+
+        pthread_mutex_unlock(&pool->mutex);
+        task(context, index);
+        pthread_mutex_lock(&pool->mutex);
+
+        pool->finished_count++;
+        if (pool->finished_count == pool->task_count) {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+}
+
+static void *thread_pool_worker(void *arg) {
+    thread_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->shutting_down) {
+        if (pool->next_index < pool->task_count) {
+            thread_pool_work(pool);
+        } else {
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+// thread_count includes the calling thread, which always takes part in
+// thread_pool_run, so a count of 0 or 1 starts no threads at all
+pngloss_error thread_pool_init(thread_pool *pool, uint_fast16_t thread_count) {
+    pool->threads = NULL;
+    pool->thread_count = 0;
+    pool->task = NULL;
+    pool->context = NULL;
+    pool->task_count = 0;
+    pool->next_index = 0;
+    pool->finished_count = 0;
+    pool->shutting_down = false;
+
+    if (pthread_mutex_init(&pool->mutex, NULL)) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_cond_init(&pool->work_ready, NULL)) {
+        pthread_mutex_destroy(&pool->mutex);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    if (pthread_cond_init(&pool->work_done, NULL)) {
+        pthread_cond_destroy(&pool->work_ready);
+        pthread_mutex_destroy(&pool->mutex);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    if (thread_count < 2) {
+        return SUCCESS;
+    }
+
+    pool->threads = calloc(thread_count - 1, sizeof(pthread_t));
+    if (!pool->threads) {
+        thread_pool_destroy(pool);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    for (uint_fast16_t i = 0; i < thread_count - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool)) {
+            // carry on with however many threads were started
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    return SUCCESS;
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint_fast16_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->thread_count = 0;
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+// Calls task once for every index in [0, task_count) and returns after all
+// of them have finished. Indexes are handed out in increasing order but may
+// complete in any order, so tasks must only write to their own results.
+void thread_pool_run(
+    thread_pool *pool, thread_pool_task task, uint32_t task_count,
+    void *context
+) {
+    if (!pool->thread_count) {
+        for (uint32_t index = 0; index < task_count; index++) {
+            task(context, index);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->context = context;
+    pool->task_count = task_count;
+    pool->next_index = 0;
+    pool->finished_count = 0;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    thread_pool_work(pool);
+    while (pool->finished_count < pool->task_count) {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,36 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rwpng.h"
+
+// runs one unit of work, index is in [0, task_count)
+typedef void (*thread_pool_task)(void *context, uint32_t index);
+
+// data structures
+typedef struct {
+    pthread_t *threads;
+    uint_fast16_t thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    thread_pool_task task;
+    void *context;
+    uint32_t task_count;
+    uint32_t next_index;
+    uint32_t finished_count;
+    bool shutting_down;
+} thread_pool;
+
+// function prototypes
+pngloss_error thread_pool_init(thread_pool *pool, uint_fast16_t thread_count);
+void thread_pool_destroy(thread_pool *pool);
+void thread_pool_run(
+    thread_pool *pool, thread_pool_task task, uint32_t task_count,
+    void *context
+);
+
+#endif // THREAD_POOL_H
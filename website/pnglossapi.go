@@ -3,6 +3,7 @@ package main
 import "bytes"
 import "crypto/sha256"
 import "encoding/base64"
+import "encoding/binary"
 import "errors"
 import "fmt"
 import "html/template"
@@ -15,7 +16,6 @@ import "net/http"
 import "net/http/fcgi"
 import "net/url"
 import "os"
-import "os/exec"
 import "strconv"
 import "sync"
 import "sync/atomic"
@@ -50,6 +50,7 @@ var originalsPrefix = "/var/pngloss/"
 const maxConcurrentPages = 2
 const maxConcurrentImages = 2
 const compressedsToCache = 10
+const pnglossSocketPath = "/var/www/run/pngloss.sock"
 var originals = OriginalsOnDisk{}
 var compresseds = CompressedsInMemory{}
 var compress = PageHandler{}
@@ -540,20 +541,7 @@ func (c *CompressedsInMemory) Compress(sum [sha256.Size224]byte, strength uint64
 		return nil, err
 	}
 
-	args := []string{
-		"-s" + strconv.FormatUint(strength, 10),
-		"-b" + strconv.FormatUint(bleed, 10),
-	}
-	if strip != 0 {
-		args = append(args, "--strip")
-	}
-	args = append(args, "-")
-
-	cmd := exec.Command("pngloss", args...)
-	cmd.Stdin = bytes.NewReader(original)
-
-	// TODO: try setting niceness of pngloss command with syscall.Setpriority(syscall.PRIO_PROCESS, pid, 20)
-	data, err = cmd.Output()
+	data, err = compressWithServer(original, strength, bleed, strip)
 	if err != nil {
 		return nil, err
 	}
@@ -569,6 +557,47 @@ func (c *CompressedsInMemory) Compress(sum [sha256.Size224]byte, strength uint64
 	return data, nil
 }
 
+// Sends one request to a resident "pngloss --serve" instead of starting a
+// process for every image.
+func compressWithServer(original []byte, strength uint64, bleed uint64, strip uint64) ([]byte, error) {
+	conn, err := net.DialTimeout("unix", pnglossSocketPath, time.Second)
+	if err != nil {
+		return nil, err
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Minute))
+
+	request := make([]byte, 12, 12 + len(original))
+	copy(request, "PNGL")
+	binary.BigEndian.PutUint32(request[4:], uint32(len(original)))
+	request[8] = byte(strength)
+	request[9] = byte(strip)
+	binary.BigEndian.PutUint16(request[10:], uint16(bleed))
+	request = append(request, original...)
+	_, err = conn.Write(request)
+	if err != nil {
+		return nil, err
+	}
+
+	header := make([]byte, 8)
+	_, err = io.ReadFull(conn, header)
+	if err != nil {
+		return nil, err
+	}
+	status := binary.BigEndian.Uint32(header)
+	if status != 0 {
+		return nil, fmt.Errorf("pngloss failed with status %d", status)
+	}
+
+	data := make([]byte, binary.BigEndian.Uint32(header[4:]))
+	_, err = io.ReadFull(conn, data)
+	if err != nil {
+		return nil, err
+	}
+
+	return data, nil
+}
+
 var pageMarkup = `<!DOCTYPE html> 
 <html lang="en">
   <head>